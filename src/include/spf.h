@@ -61,6 +61,8 @@
 #define SPF_DEFAULT_MAX_DNS_MX	 10	/**< DoS limit on MX records.	*/
 #define SPF_DEFAULT_SANITIZE	  1
 #define SPF_DEFAULT_WHITELIST	  "include:spf.trusted-forwarder.org"
+#define SPF_EXP_CACHE_BITS		  6		/**< Chains in the exp= cache.	*/
+#define SPF_EXP_CACHE_MAX_TTL	  3600	/**< Longest life of an exp=.	*/
 #define SPF_EXP_MOD_NAME	"exp-text"
 /** The default SPF explanation, if no other is provided in the
  * SPF_server_t object. */
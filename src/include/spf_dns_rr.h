@@ -61,7 +61,7 @@ struct SPF_dns_rr_struct
     size_t				*rr_buf_len;/**< Alloced size of each RR.	*/
     int					 rr_buf_num;/**< Number of RR allocated.	*/
 
-    time_t				 ttl;		/**< Raw TTL.			*/
+    time_t				 ttl;		/**< Raw TTL, or SPF_DNS_TTL_NONE.	*/
     time_t				 utc_ttl;	/**< TTL adjusted to UTC.		*/
     SPF_dns_stat_t		 herrno;	/**< h_error returned from query.	*/
 
@@ -70,6 +70,9 @@ struct SPF_dns_rr_struct
     SPF_dns_server_t	*source;	/**< Which layer created this RR.  */
 } SPF_dns_rr_t;
 
+/** The ttl of an answer which carried none. A ttl of 0 is real. */
+#define SPF_DNS_TTL_NONE	(-1)
+
 SPF_dns_rr_t	*SPF_dns_rr_new(void);
 void			 SPF_dns_rr_free(SPF_dns_rr_t *spfrr);
 SPF_dns_rr_t	*SPF_dns_rr_new_init(SPF_dns_server_t *spf_dns_server,
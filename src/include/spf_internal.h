@@ -68,6 +68,14 @@
  */
 #define SPF_MAX_DNS_MX    10
 #endif
+#ifndef SPF_MAX_INCLUDE_DEPTH
+/**
+ * The deepest nesting of include: and redirect= that will be
+ * evaluated.  Each level costs a DNS mechanism, so SPF_MAX_DNS_MECH
+ * will normally stop the evaluation well before this.
+ */
+#define SPF_MAX_INCLUDE_DEPTH 20
+#endif
 
 #if 1
 #define _ALIGN_SZ	4
@@ -104,9 +112,10 @@ static inline struct in_addr *SPF_mech_ip4_data( SPF_mech_t *mech )
 static inline struct in6_addr *SPF_mech_ip6_data( SPF_mech_t *mech )
     { return (struct in6_addr *)( (char *)mech + sizeof(SPF_mech_t)); }
 
+/* String data is stored with a terminating '\0', not counted in len. */
 static inline size_t SPF_data_len( SPF_data_t *data )
     { return sizeof(SPF_data_t) +
-			(data->ds.parm_type == PARM_STRING ? data->ds.len : 0); }
+			(data->ds.parm_type == PARM_STRING ? data->ds.len + 1 : 0); }
 static inline SPF_data_t *SPF_data_next( SPF_data_t *data )
     { return (SPF_data_t *)_align_ptr(
 		(char *)data + SPF_data_len(data)
@@ -137,6 +146,54 @@ static inline SPF_data_t *SPF_macro_data( SPF_macro_t * mac )
 
 char *SPF_sanitize( SPF_server_t *spf_server, char *str );
 
+/** In spf_record.c */
+SPF_record_t	*SPF_record_alloc(int num_mech, size_t mech_len,
+					int num_mod, size_t mod_len);
+void			 SPF_record_index_mods(SPF_record_t *spf_record);
+static inline unsigned short *SPF_record_mech_vars_first( SPF_record_t *rp )
+    { return (unsigned short *)((char *)rp + rp->mech_vars_off); }
+static inline unsigned short *SPF_record_mod_vars_first( SPF_record_t *rp )
+    { return (unsigned short *)((char *)rp + rp->mod_vars_off); }
+
+/** In spf_compile.c */
+int				 SPF_record_local_policy_idx(SPF_record_t *spf_record);
+
+/** In spf_response.c */
+void SPF_response_add_ttl(SPF_response_t *rp, SPF_dns_rr_t *rr);
+void SPF_response_limit_ttl(SPF_response_t *rp, time_t ttl);
+
+/** In spf_result_cache.c */
+SPF_result_cache_t	*SPF_result_cache_new(int cache_bits, time_t max_ttl);
+void			 SPF_result_cache_free(SPF_result_cache_t *cache);
+void			 SPF_result_cache_flush(SPF_result_cache_t *cache);
+void			 SPF_result_cache_stats(SPF_result_cache_t *cache,
+					unsigned long *hitsp, unsigned long *missesp);
+int				 SPF_result_cache_find(SPF_result_cache_t *cache,
+					SPF_request_t *spf_request,
+					SPF_response_t *spf_response,
+					SPF_errcode_t *errp);
+SPF_errcode_t	 SPF_result_cache_add(SPF_result_cache_t *cache,
+					SPF_request_t *spf_request,
+					SPF_response_t *spf_response,
+					SPF_errcode_t query_err);
+
+/** In spf_exp_cache.c */
+SPF_exp_cache_t	*SPF_exp_cache_new(int cache_bits, time_t max_ttl);
+void			 SPF_exp_cache_free(SPF_exp_cache_t *cache);
+void			 SPF_exp_cache_flush(SPF_exp_cache_t *cache);
+void			 SPF_exp_cache_stats(SPF_exp_cache_t *cache,
+					unsigned long *hitsp, unsigned long *missesp);
+int				 SPF_exp_cache_find(SPF_exp_cache_t *cache,
+					SPF_response_t *spf_response,
+					const char *domain,
+					SPF_macro_t **spf_macrop,
+					char **bufp, size_t *buflenp);
+SPF_errcode_t	 SPF_exp_cache_add(SPF_exp_cache_t *cache,
+					const char *domain,
+					SPF_dns_rr_t *rr,
+					SPF_macro_t *spf_macro,
+					const char *text);
+
 void SPF_print_sizeof(void);
 
 /**
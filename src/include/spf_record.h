@@ -31,7 +31,8 @@ typedef struct SPF_macro_struct SPF_macro_t;
  *
  * Compiled SPF record
  *
- * The compiled form of the SPF record is as follows:
+ * The compiled form of the SPF record is as follows, all in a single
+ * allocation:
  *
  * * A four byte header which contains the version, and information
  *   about the mechanisms and modifiers
@@ -55,6 +56,10 @@ typedef struct SPF_macro_struct SPF_macro_t;
  *         * two byte macro variable description
  *
  *         * two byte string description, followed by the string
+ *           and a terminating NUL (not counted in the length)
+ *
+ *       * A mechanism with no macro variables has exactly one string
+ *         block, which can be used as the target domain as it stands
  *
  *   * Modifier information, repeated once for each modifier
  *
@@ -67,6 +72,7 @@ typedef struct SPF_macro_struct SPF_macro_t;
  *         * two byte macro variable description
  *
  *         * two byte string description, followed by the string
+ *           and a terminating NUL
  */
 
 
@@ -99,6 +105,19 @@ typedef struct SPF_macro_struct SPF_macro_t;
 #define PARM_CIDR		11	/**< CIDR lengths (IPv4 and v6)	*/
 #define PARM_STRING		12	/**< literal string		*/
 
+/**
+ * Macro dependency masks
+ *
+ * The compiler records, for each mechanism and modifier, which macro
+ * variables its data refers to: bit SPF_VAR_BIT(PARM_x) is set if
+ * %{x} appears.  A mask of 0 means the data is a constant string.
+ */
+#define SPF_VAR_BIT(parm)	(1U << (parm))
+/** Variables which do not vary between clients for a given record. */
+#define SPF_VAR_STATIC		( SPF_VAR_BIT(PARM_CUR_DOM)		\
+							| SPF_VAR_BIT(PARM_REC_DOM)		\
+							| SPF_VAR_BIT(PARM_CLIENT_VER) )
+
 
 typedef
 struct SPF_data_str_struct
@@ -192,31 +211,66 @@ struct SPF_mod_struct
     /** data: (SPF_data_t[] = char[data_len]) follows */
 } SPF_mod_t;
 
+/**
+ * Modifiers which the library itself looks up, and which the
+ * compiler therefore indexes.  redirect= is compiled as a mechanism,
+ * since it is acted upon in sequence.
+ */
+typedef
+enum SPF_mod_known_enum {
+	SPF_MOD_KNOWN_EXP,			/**< exp=			*/
+	SPF_MOD_KNOWN_EXP_TEXT,		/**< SPF_EXP_MOD_NAME	*/
+	SPF_MOD_KNOWN_MAX
+} SPF_mod_known_t;
+
 
 
 /**
  * Compiled SPF records as used internally by libspf2
+ *
+ * A record does not refer to the server which compiled it. The
+ * server is taken from the request at evaluation time, so one record
+ * may be shared by any number of servers.
  */
 struct SPF_record_struct
 {
-	SPF_server_t	*spf_server;
-
     /* Header */
     unsigned char	 version;		/**< SPF spec version number.	*/
     unsigned char	 num_mech;		/**< Number of mechanisms. 	*/
     unsigned char	 num_mod;		/**< Number of modifiers.		*/
     unsigned char	 num_dns_mech;	/**< Number of DNS mechanisms.	*/
 
-    /* Data */
-    SPF_mech_t		*mech_first;	/**< Buffer for mechanisms.	*/
-    size_t			 mech_size;		/**< Malloc'ed size.			*/
-    size_t			 mech_len;		/**< Used size (non-network format). */
-
-    SPF_mod_t		*mod_first;		/**< Buffer for modifiers.		*/
-    size_t			 mod_size;		/**< Malloc'ed size.			*/
-    size_t			 mod_len;		/**< Used size (non-network format). */
+	/** Mechanism after which the local policy runs, or -1. */
+	int				 local_policy_idx;
+	/** Offset in the modifiers of each known modifier, or -1. */
+	int				 mod_known_off[SPF_MOD_KNOWN_MAX];
+
+	/*
+	 * Data. This follows the header in the same allocation, and is
+	 * found by offsets from the start of the record, so that the
+	 * record as a whole may be copied with memcpy().
+	 */
+	size_t			 rec_len;		/**< Size of the whole allocation. */
+	size_t			 mech_off;		/**< Offset of the mechanisms.	*/
+	size_t			 mech_len;		/**< Used size (non-network format). */
+	size_t			 mod_off;		/**< Offset of the modifiers.	*/
+	size_t			 mod_len;		/**< Used size (non-network format). */
+
+	/* Macro dependencies, indexed by mechanism/modifier number. */
+	size_t			 mech_vars_off;	/**< SPF_VAR_BIT mask per mechanism. */
+	size_t			 mod_vars_off;	/**< SPF_VAR_BIT mask per modifier. */
 };
 
+/**
+ * The first mechanism and the first modifier of a compiled record.
+ * These replace the mech_first and mod_first pointers of earlier
+ * versions.
+ */
+static inline SPF_mech_t *SPF_record_mech_first( SPF_record_t *rp )
+    { return (SPF_mech_t *)((char *)rp + rp->mech_off); }
+static inline SPF_mod_t *SPF_record_mod_first( SPF_record_t *rp )
+    { return (SPF_mod_t *)((char *)rp + rp->mod_off); }
+
 struct SPF_macro_struct
 {
     size_t			 macro_len;	/**< bytes of data */
@@ -241,6 +295,17 @@ SPF_errcode_t	 SPF_record_find_mod_value(SPF_server_t *spf_server,
 			SPF_record_t *spf_record,
 			const char *mod_name,
 			char **bufp, size_t *buflenp);
+SPF_errcode_t	 SPF_record_get_mod_value(SPF_server_t *spf_server,
+			SPF_request_t *spf_request,
+			SPF_response_t *spf_response,
+			SPF_record_t *spf_record,
+			SPF_mod_known_t mod_known,
+			char **bufp, size_t *buflenp);
+unsigned int	 SPF_data_var_mask(SPF_data_t *data, size_t data_len);
+unsigned int	 SPF_record_mech_vars(SPF_record_t *spf_record, int idx);
+unsigned int	 SPF_record_mod_vars(SPF_record_t *spf_record, int idx);
+int				 SPF_record_mech_should_cache(SPF_record_t *spf_record,
+			int idx);
 
 /** In spf_compile.c */
 SPF_errcode_t	 SPF_record_compile(SPF_server_t *spf_server,
@@ -263,6 +328,11 @@ SPF_errcode_t	 SPF_record_expand_data(SPF_server_t *spf_server,
 			SPF_response_t *spf_response,
 			SPF_data_t *data, size_t data_len,
 			char **bufp, size_t *buflenp);
+/** In spf_serialize.c */
+SPF_errcode_t	 SPF_record_serialize(SPF_record_t *spf_record,
+			void **datap, size_t *lenp);
+SPF_errcode_t	 SPF_record_deserialize(SPF_record_t **spf_recordp,
+			const void *data, size_t len);
 /** In spf_print.c */
 SPF_errcode_t	 SPF_record_print(SPF_record_t *spf_record);
 SPF_errcode_t	 SPF_record_stringify(SPF_record_t *spf_record,
@@ -48,6 +48,11 @@ struct SPF_request_struct {
 
 	/* I'm not sure whether this should be in here. */
 	const char		*cur_dom;		/* "current domain" of SPF spec */
+
+	/* Macro variables, formatted on first use; "" until then. */
+	char			 client_ip[sizeof(struct in6_addr) * 4];	/* %{i} */
+	char			 client_ip_p[INET6_ADDRSTRLEN];	/* %{c} */
+	char			 time_str[sizeof("-9223372036854775808")];	/* %{t} */
 };
 
 SPF_request_t	*SPF_request_new(SPF_server_t *spf_server);
@@ -67,6 +72,18 @@ int				 SPF_request_set_env_from(SPF_request_t *sr,
 const char		*SPF_request_get_rec_dom(SPF_request_t *sr);
 
 const char		*SPF_request_get_client_dom(SPF_request_t *sr);
+/**
+ * The values of %{i}, %{c} and %{t}. Each is formatted the first time
+ * it is asked for, so every mechanism, include and explanation of a
+ * request shares one copy. %{i} and %{c} are kept until the client
+ * address changes. %{t} is the time at which it was first asked for,
+ * and is kept until the client address, HELO domain or envelope
+ * sender changes, so a request reused for the next message gets a new
+ * one. %{i} and %{c} are NULL if no client address has been set.
+ */
+const char		*SPF_request_get_client_ip(SPF_request_t *sr);
+const char		*SPF_request_get_client_ip_p(SPF_request_t *sr);
+const char		*SPF_request_get_time(SPF_request_t *sr);
 int				 SPF_request_is_loopback(SPF_request_t *sr);
 
 SPF_errcode_t	 SPF_request_query_mailfrom(SPF_request_t *spf_request,
@@ -151,6 +151,7 @@ enum SPF_errcode_t {
 ,	SPF_E_INCLUDE_RETURNED_NONE	/**< If an include recursive query returns none it's a perm error */
 ,	SPF_E_RECURSIVE			/**< Recursive include */
 ,	SPF_E_MULTIPLE_RECORDS	/**< Multiple SPF or TXT records found */
+,	SPF_E_INVALID_RECORD	/**< Invalid serialized record	*/
 } SPF_errcode_t;
 
 typedef
@@ -190,6 +191,10 @@ struct SPF_response_struct {
 
 	/* Stuff which lets us get there. */
 	int				 num_dns_mech;
+
+	/* What the answer depended upon, for the result cache. */
+	unsigned int	 var_mask;		/**< Macro variables expanded, by PARM_ */
+	time_t			 ttl;			/**< Shortest DNS TTL, 0 none, -1 never */
 };
 
 
@@ -17,6 +17,8 @@
 #define INC_SPF_SERVER
 
 typedef struct SPF_server_struct SPF_server_t;
+typedef struct SPF_result_cache_struct SPF_result_cache_t;
+typedef struct SPF_exp_cache_struct SPF_exp_cache_t;
 
 #include "spf_record.h"
 #include "spf_dns.h"
@@ -52,6 +54,15 @@ typedef struct SPF_server_struct SPF_server_t;
 #define SPF_MAX_DNS_MX    10
 #endif
 
+/**
+ * How much diagnostic work SPF_record_compile() does.
+ */
+typedef
+enum SPF_compile_mode_enum {
+	SPF_COMPILE_DIAGNOSTIC,		/**< Lint records, poison buffers. */
+	SPF_COMPILE_PRODUCTION		/**< Only what evaluation needs. */
+} SPF_compile_mode_t;
+
 struct SPF_server_struct {
 	SPF_dns_server_t*resolver;		/**< SPF DNS resolver. */
 	SPF_record_t	*local_policy;	/**< Local policies. */
@@ -66,6 +77,10 @@ struct SPF_server_struct {
 	int				 sanitize;		/**< Limit charset in messages. */
 	int				 debug;			/**< Print debug info. */
 	int				 destroy_resolver;	/**< true if we own the resolver. */
+	SPF_compile_mode_t	 compile_mode;	/**< Diagnostics when compiling. */
+
+	SPF_result_cache_t	*result_cache;	/**< Complete results, or NULL. */
+	SPF_exp_cache_t		*exp_cache;		/**< exp= explanations, or NULL. */
 };
 
 typedef
@@ -80,12 +95,63 @@ SPF_errcode_t	 SPF_server_set_rec_dom(SPF_server_t *sp,
 					const char *dom);
 SPF_errcode_t	 SPF_server_set_sanitize(SPF_server_t *sp,
 					int sanitize);
+/**
+ * In SPF_COMPILE_PRODUCTION mode the compiler skips SPF_record_lint()
+ * and the poisoning of its scratch buffers, so records compiled for
+ * evaluation carry errors but no lint warnings. The default is
+ * SPF_COMPILE_DIAGNOSTIC, which is what spftest and spfquery want.
+ */
+SPF_errcode_t	 SPF_server_set_compile_mode(SPF_server_t *sp,
+					SPF_compile_mode_t mode);
 SPF_errcode_t	 SPF_server_set_explanation(SPF_server_t *sp,
 					const char *exp, SPF_response_t **spf_responsep);
 SPF_errcode_t	 SPF_server_set_localpolicy(SPF_server_t *sp,
 					const char *policy, int use_default_whitelist,
 					SPF_response_t **spf_responsep);
 
+/**
+ * Enables a cache of complete SPF results in front of the interpreter.
+ * Each entry is keyed by the domain, the client IP and whichever
+ * macro variables the evaluation actually expanded, and expires with
+ * the shortest TTL of the DNS answers it consulted, capped at max_ttl.
+ * A hit is answered without any DNS lookup or record compilation.
+ *
+ * The cache holds 2^cache_bits hash chains. A cache_bits of 0 disables
+ * the cache. Results which expand %{t} or end in a temporary error are
+ * never cached. Changing the local policy, explanation, receiving
+ * domain or DNS limits empties the cache.
+ */
+SPF_errcode_t	 SPF_server_set_result_cache(SPF_server_t *sp,
+					int cache_bits, time_t max_ttl);
+/**
+ * Sizes the cache of explanations fetched with exp=. Each entry holds
+ * the compiled explanation published at one exp domain, and, if it
+ * refers to no request variable other than %{r}, its expansion. Entries
+ * expire with the TTL of the TXT answer, capped at max_ttl.
+ *
+ * The cache is enabled by default with 2^SPF_EXP_CACHE_BITS hash chains
+ * and a max_ttl of SPF_EXP_CACHE_MAX_TTL. A cache_bits of 0 disables
+ * it. Changing the receiving domain empties the cache.
+ */
+SPF_errcode_t	 SPF_server_set_exp_cache(SPF_server_t *sp,
+					int cache_bits, time_t max_ttl);
+
+/**
+ * How often the result and explanation caches have been consulted,
+ * and how often they had the answer. The counts start from zero when
+ * a cache is created or resized, and are kept across a flush.
+ */
+typedef
+struct SPF_server_stats_struct {
+	unsigned long	 result_hits;
+	unsigned long	 result_misses;
+	unsigned long	 exp_hits;
+	unsigned long	 exp_misses;
+} SPF_server_stats_t;
+
+void			 SPF_server_get_stats(SPF_server_t *sp,
+					SPF_server_stats_t *stats);
+
 SPF_errcode_t	 SPF_server_get_record(SPF_server_t *spf_server,
 					SPF_request_t *spf_request,
 					SPF_response_t *spf_response,
@@ -88,6 +88,30 @@ static const SPF_mechtype_t spf_mechtypes[] = {
 	{ MECH_REDIRECT,	TRUE,		DOMSPEC_REQUIRED,	CIDR_NONE },
 };
 
+/**
+ * A record under construction. The mechanisms and modifiers are
+ * grown in separate buffers, then SPF_c_record_finalize() packs
+ * them into a single exactly sized SPF_record_t.
+ */
+typedef
+struct SPF_c_record_struct
+{
+	unsigned char	 num_mech;		/**< Number of mechanisms. 	*/
+	unsigned char	 num_mod;		/**< Number of modifiers.		*/
+	unsigned char	 num_dns_mech;	/**< Number of DNS mechanisms.	*/
+
+	SPF_mech_t		*mech_first;	/**< Buffer for mechanisms.	*/
+	size_t			 mech_size;		/**< Malloc'ed size.			*/
+	size_t			 mech_len;		/**< Used size.				*/
+
+	SPF_mod_t		*mod_first;		/**< Buffer for modifiers.		*/
+	size_t			 mod_size;		/**< Malloc'ed size.			*/
+	size_t			 mod_len;		/**< Used size.				*/
+
+	unsigned short	*mech_vars;		/**< SPF_VAR_BIT mask per mechanism. */
+	unsigned short	*mod_vars;		/**< SPF_VAR_BIT mask per modifier. */
+} SPF_c_record_t;
+
 #define spf_num_mechanisms \
 		sizeof(spf_mechtypes) / sizeof(spf_mechtypes[0])
 
@@ -120,6 +144,23 @@ SPF_c_ensure_capacity(void **datap, size_t *sizep, size_t length)
 	return 0;
 }
 
+/**
+ * Records the macro dependencies of mechanism or modifier number idx.
+ */
+__attribute__((warn_unused_result))
+static int
+SPF_c_vars_set(unsigned short **varsp, int idx, unsigned int mask)
+{
+	unsigned short	*tmp;
+
+	tmp = realloc(*varsp, (idx + 1) * sizeof(unsigned short));
+	if (!tmp)
+		return -1;
+	tmp[idx] = mask;
+	*varsp = tmp;
+	return 0;
+}
+
 /**
  * Parses an ip6 CIDR.
  *
@@ -455,11 +496,12 @@ SPF_c_parse_var(SPF_response_t *spf_response, SPF_data_var_t *data,
 			/* Magic numbers for x/Nc in gdb. */					\
 			data->ds.__unused0 = 0xba; data->ds.__unused1 = 0xbe;	\
 			dst = SPF_data_str( data );								\
-			if ((_avail) < sizeof(SPF_data_t))						\
+			/* Leave room for the terminating '\0'. */				\
+			if ((_avail) < sizeof(SPF_data_t) + 1)					\
 				return SPF_response_add_error_ptr(spf_response,		\
 									SPF_E_BIG_STRING, NULL, src,	\
 								"Out of memory for string literal");\
-			ds_avail = (_avail) - sizeof(SPF_data_t);				\
+			ds_avail = (_avail) - sizeof(SPF_data_t) - 1;			\
 			ds_len = 0;												\
 		} while(0)
 
@@ -482,8 +524,9 @@ SPF_c_parse_var(SPF_response_t *spf_response, SPF_data_var_t *data,
 								ds_len, SPF_MAX_STR_LEN);			\
 				}													\
 				data->ds.len = ds_len;								\
-				len = sizeof( *data ) + ds_len;						\
+				len = sizeof( *data ) + ds_len + 1;					\
 				SPF_ADD_LEN_TO(*data_used, len, data_avail);		\
+				*dst = '\0';											\
 				data = SPF_data_next( data );						\
 				ds_len = 0;											\
 			}														\
@@ -722,6 +765,168 @@ SPF_c_parse_domainspec(SPF_server_t *spf_server,
 }
 
 
+/**
+ * Reads a dotted-quad IPv4 address into dst, accepting exactly what
+ * inet_pton(AF_INET) accepts.
+ *
+ * Returns a pointer to the character after the address, or NULL if
+ * there is no valid address at src.
+ */
+static const char *
+SPF_c_scan_ip4(const char *src, unsigned char *dst)
+{
+	unsigned int	 val;
+	int				 digits;
+	int				 octets;
+
+	for (octets = 0; ; src++) {
+		val = 0;
+		for (digits = 0; *src >= '0' && *src <= '9'; digits++, src++) {
+			if (digits > 0 && val == 0)		/* No leading zeros. */
+				return NULL;
+			val = val * 10 + (*src - '0');
+			if (val > 255)
+				return NULL;
+		}
+		if (digits == 0)
+			return NULL;
+		dst[octets++] = val;
+		if (octets == 4)
+			return src;
+		if (*src != '.')
+			return NULL;
+	}
+}
+
+static inline int
+SPF_c_hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Reads an IPv6 address into dst, accepting exactly what
+ * inet_pton(AF_INET6) accepts. The address ends at a space, a '/' or
+ * the end of the string.
+ *
+ * Returns a pointer to the character after the address, or NULL if
+ * there is no valid address at src.
+ */
+static const char *
+SPF_c_scan_ip6(const char *src, unsigned char *dst)
+{
+	unsigned char	 tmp[16];
+	unsigned char	*tp;
+	unsigned char	*colonp;
+	const char		*curtok;
+	unsigned int	 val;
+	int				 digits;
+	int				 x;
+	size_t			 n;
+
+	memset(tmp, 0, sizeof(tmp));
+	tp = tmp;
+	colonp = NULL;
+
+	/* A leading :: needs special handling. */
+	if (*src == ':' && *++src != ':')
+		return NULL;
+
+	curtok = src;
+	val = 0;
+	digits = 0;
+	for (; *src != ' ' && *src != '/' && *src != '\0'; src++) {
+		if ((x = SPF_c_hexval(*src)) >= 0) {
+			if (++digits > 4)
+				return NULL;
+			val = (val << 4) | x;
+			continue;
+		}
+		if (*src == ':') {
+			curtok = src + 1;
+			if (digits == 0) {
+				if (colonp)
+					return NULL;
+				colonp = tp;
+				continue;
+			}
+			if (*curtok == ' ' || *curtok == '/' || *curtok == '\0')
+				return NULL;
+			if (tp + 2 > tmp + sizeof(tmp))
+				return NULL;
+			*tp++ = (val >> 8) & 0xff;
+			*tp++ = val & 0xff;
+			val = 0;
+			digits = 0;
+			continue;
+		}
+		if (*src == '.' && tp + 4 <= tmp + sizeof(tmp)) {
+			src = SPF_c_scan_ip4(curtok, tp);
+			if (src == NULL)
+				return NULL;
+			tp += 4;
+			digits = 0;
+			break;
+		}
+		return NULL;
+	}
+
+	if (digits > 0) {
+		if (tp + 2 > tmp + sizeof(tmp))
+			return NULL;
+		*tp++ = (val >> 8) & 0xff;
+		*tp++ = val & 0xff;
+	}
+	if (colonp != NULL) {
+		/* Shift the groups after the :: to the end. */
+		if (tp == tmp + sizeof(tmp))
+			return NULL;
+		n = tp - colonp;
+		memmove(tmp + sizeof(tmp) - n, colonp, n);
+		memset(colonp, 0, tmp + sizeof(tmp) - n - colonp);
+		tp = tmp + sizeof(tmp);
+	}
+	if (tp != tmp + sizeof(tmp))
+		return NULL;
+
+	memcpy(dst, tmp, sizeof(tmp));
+	return src;
+}
+
+/**
+ * Reads an optional CIDR length of 1 to max after an address, where
+ * max is stored as 0. Leaves anything out of the ordinary, including
+ * all errors, to SPF_c_parse_cidr_ip4() and SPF_c_parse_cidr_ip6().
+ *
+ * Returns a pointer to the end of the term, or NULL.
+ */
+static const char *
+SPF_c_scan_mask(const char *src, unsigned int max, unsigned char *maskp)
+{
+	unsigned int	 val;
+	int				 digits;
+
+	val = 0;
+	if (*src == '/') {
+		for (digits = 0, src++; *src >= '0' && *src <= '9'; digits++, src++)
+			val = val * 10 + (*src - '0');
+		if (digits == 0 || digits > 3 || val == 0 || val > max)
+			return NULL;
+		if (val == max)
+			val = 0;
+	}
+	if (*src != ' ' && *src != '\0')
+		return NULL;
+	*maskp = val;
+	return src;
+}
+
 /**
  * Parses the data for an ip4 mechanism.
  *
@@ -741,6 +946,15 @@ SPF_c_parse_ip4(SPF_response_t *spf_response, SPF_mech_t *mech, char const *star
 	struct in_addr		*addr;
 
 	start++;
+
+	/* Read the usual case straight into the mechanism. */
+	p = SPF_c_scan_ip4(start, (unsigned char *)SPF_mech_ip4_data(mech));
+	if (p != NULL && SPF_c_scan_mask(p, 32, &mask) != NULL) {
+		mech->mech_len = mask;
+		return SPF_E_SUCCESS;
+	}
+
+	/* Go the long way round, to report the error. */
 	len = strcspn(start, " ");
 	end = start + len;
 	p = end - 1;
@@ -790,6 +1004,15 @@ SPF_c_parse_ip6(SPF_response_t *spf_response, SPF_mech_t *mech, char const *star
 	struct in6_addr		*addr;
 
 	start++;
+
+	/* Read the usual case straight into the mechanism. */
+	p = SPF_c_scan_ip6(start, (unsigned char *)SPF_mech_ip6_data(mech));
+	if (p != NULL && SPF_c_scan_mask(p, 128, &mask) != NULL) {
+		mech->mech_len = mask;
+		return SPF_E_SUCCESS;
+	}
+
+	/* Go the long way round, to report the error. */
 	len = strcspn(start, " ");
 	end = start + len;
 	p = end - 1;
@@ -826,7 +1049,7 @@ SPF_c_parse_ip6(SPF_response_t *spf_response, SPF_mech_t *mech, char const *star
 __attribute__((warn_unused_result))
 static SPF_errcode_t
 SPF_c_mech_add(SPF_server_t *spf_server,
-				SPF_record_t *spf_record, SPF_response_t *spf_response,
+				SPF_c_record_t *spf_record, SPF_response_t *spf_response,
 				const SPF_mechtype_t *mechtype, int prefix,
 				const char **mech_value)
 {
@@ -843,7 +1066,8 @@ ALIGN_DECL(
 
 	SPF_errcode_t		 err;
 
-	memset(u.buf, 'B', sizeof(u.buf));	/* Poison the buffer. */
+	if (spf_server->compile_mode == SPF_COMPILE_DIAGNOSTIC)
+		memset(u.buf, 'B', sizeof(u.buf));	/* Poison the buffer. */
 	memset(spf_mechanism, 0, sizeof(SPF_mech_t));
 
 	if (spf_server->debug)
@@ -969,6 +1193,16 @@ ALIGN_DECL(
 							SPF_E_NO_MEMORY,
 							NULL, NULL,
 							"Failed to allocate memory for mechanism");
+		/* The ip4/ip6 data is an address, not a macro-string. */
+		if (SPF_c_vars_set(&spf_record->mech_vars, spf_record->num_mech,
+							(mechtype->mech_type == MECH_IP4
+							 || mechtype->mech_type == MECH_IP6)
+								? 0
+								: SPF_data_var_mask(data, data_len)) < 0)
+			return SPF_response_add_error_ptr(spf_response,
+							SPF_E_NO_MEMORY,
+							NULL, NULL,
+							"Failed to allocate memory for mechanism");
 		memcpy( (char *)spf_record->mech_first + spf_record->mech_len,
 			spf_mechanism,
 			len);
@@ -984,7 +1218,7 @@ ALIGN_DECL(
 __attribute__((warn_unused_result))
 static SPF_errcode_t
 SPF_c_mod_add(SPF_server_t *spf_server,
-				SPF_record_t *spf_record, SPF_response_t *spf_response,
+				SPF_c_record_t *spf_record, SPF_response_t *spf_response,
 				const char *mod_name, size_t name_len,
 				const char **mod_value)
 {
@@ -1005,7 +1239,8 @@ ALIGN_DECL(
 		SPF_debugf("Adding modifier name=%lu@%s, value=%s",
 						(unsigned long)name_len, mod_name, *mod_value);
 
-	memset(u.buf, 'A', sizeof(u.buf));
+	if (spf_server->compile_mode == SPF_COMPILE_DIAGNOSTIC)
+		memset(u.buf, 'A', sizeof(u.buf));
 	memset(spf_modifier, 0, sizeof(SPF_mod_t));
 
 	if ( name_len > SPF_MAX_MOD_LEN )
@@ -1045,6 +1280,12 @@ ALIGN_DECL(
 							SPF_E_NO_MEMORY,
 							NULL, NULL,
 							"Failed to allocate memory for modifier");
+		if (SPF_c_vars_set(&spf_record->mod_vars, spf_record->num_mod,
+							SPF_data_var_mask(data, data_len)) < 0)
+			return SPF_response_add_error_ptr(spf_response,
+							SPF_E_NO_MEMORY,
+							NULL, NULL,
+							"Failed to allocate memory for modifier");
 		memcpy( (char *)spf_record->mod_first + spf_record->mod_len,
 			spf_modifier,
 			len);
@@ -1055,6 +1296,110 @@ ALIGN_DECL(
 	return err;
 }
 
+static void
+SPF_c_record_clear(SPF_c_record_t *spf_c_record)
+{
+	if (spf_c_record->mech_first)
+		free(spf_c_record->mech_first);
+	if (spf_c_record->mod_first)
+		free(spf_c_record->mod_first);
+	if (spf_c_record->mech_vars)
+		free(spf_c_record->mech_vars);
+	if (spf_c_record->mod_vars)
+		free(spf_c_record->mod_vars);
+	memset(spf_c_record, 0, sizeof(SPF_c_record_t));
+}
+
+/**
+ * Packs a record under construction into a single allocation:
+ * header, mechanisms, modifiers and macro dependency masks, with
+ * no slack. The buffers of spf_c_record are released either way.
+ */
+static SPF_errcode_t
+SPF_c_record_finalize(SPF_c_record_t *spf_c_record,
+				SPF_record_t **spf_recordp)
+{
+	SPF_record_t	*spf_record;
+
+	spf_record = SPF_record_alloc(spf_c_record->num_mech, spf_c_record->mech_len,
+					spf_c_record->num_mod, spf_c_record->mod_len);
+	if (spf_record == NULL) {
+		SPF_c_record_clear(spf_c_record);
+		return SPF_E_NO_MEMORY;
+	}
+
+	spf_record->num_dns_mech = spf_c_record->num_dns_mech;
+	if (spf_c_record->mech_len)
+		memcpy(SPF_record_mech_first(spf_record),
+				spf_c_record->mech_first, spf_c_record->mech_len);
+	if (spf_c_record->mod_len)
+		memcpy(SPF_record_mod_first(spf_record),
+				spf_c_record->mod_first, spf_c_record->mod_len);
+	if (spf_c_record->num_mech)
+		memcpy(SPF_record_mech_vars_first(spf_record),
+				spf_c_record->mech_vars,
+				spf_c_record->num_mech * sizeof(unsigned short));
+	if (spf_c_record->num_mod)
+		memcpy(SPF_record_mod_vars_first(spf_record),
+				spf_c_record->mod_vars,
+				spf_c_record->num_mod * sizeof(unsigned short));
+	SPF_record_index_mods(spf_record);
+
+	SPF_c_record_clear(spf_c_record);
+	*spf_recordp = spf_record;
+	return SPF_E_SUCCESS;
+}
+
+/**
+ * Finds the location for the whitelist execution.
+ *
+ * Philip Gladstone says:
+ *
+ * I think that the localpolicy should only be inserted if the
+ * final mechanism is '-all', and it should be inserted after
+ * the last mechanism which is not '-'.
+ *
+ * Thus for the case of 'v=spf1 +a +mx -all', this would be
+ * interpreted as 'v=spf1 +a +mx +localpolicy -all'. Whereas
+ * 'v=spf1 -all' would remain the same (no non-'-'
+ * mechanism). 'v=spf1 +a +mx -exists:%stuff -all' would
+ * become 'v=spf1 +a +mx +localpolicy -exists:%stuff -all'.
+ *
+ * This depends only upon the record, so it is done once here
+ * rather than on every evaluation.
+ */
+int
+SPF_record_local_policy_idx(SPF_record_t *spf_record)
+{
+	SPF_mech_t		*mech;
+	int				 found_all;
+	int				 local_policy;
+	int				 i;
+
+	found_all = FALSE;
+	local_policy = -1;
+
+	mech = SPF_record_mech_first(spf_record);
+	for (i = 0; i < spf_record->num_mech; i++) {
+		if ( mech->mech_type == MECH_ALL
+			 && (mech->prefix_type == PREFIX_FAIL
+				 || mech->prefix_type == PREFIX_UNKNOWN
+				 || mech->prefix_type == PREFIX_SOFTFAIL
+				 )
+			)
+			found_all = TRUE;
+
+		if ( mech->prefix_type != PREFIX_FAIL
+			 && mech->prefix_type != PREFIX_SOFTFAIL
+			)
+			local_policy = i;
+
+		mech = SPF_mech_next( mech );
+	}
+
+	return found_all ? local_policy : -1;
+}
+
 static void
 SPF_record_lint(SPF_server_t *spf_server,
 								SPF_response_t *spf_response,
@@ -1076,7 +1421,7 @@ SPF_record_lint(SPF_server_t *spf_server,
 	/* FIXME  these warnings suck.  Should call SPF_id2str to give more
 	 * context. */
 
-	mech = spf_record->mech_first;
+	mech = SPF_record_mech_first(spf_record);
 	for (i = 0;
 					i < spf_record->num_mech;
 						i++,
@@ -1187,6 +1532,7 @@ SPF_record_compile(SPF_server_t *spf_server,
 								const char *record)
 {
 	const SPF_mechtype_t*mechtype;
+	SPF_c_record_t		 spf_c_record;
 	SPF_record_t		*spf_record;
 	SPF_error_t			*spf_error;
 	SPF_errcode_t		 err;
@@ -1235,15 +1581,7 @@ SPF_record_compile(SPF_server_t *spf_server,
 						NULL, p,
 						"Could not find a valid SPF record");
 
-	spf_record = SPF_record_new(spf_server, record);
-	if (spf_record == NULL) {
-		*spf_recordp = NULL;
-		return SPF_response_add_error_ptr(spf_response, SPF_E_NO_MEMORY,
-						NULL, p,
-						"Failed to allocate an SPF record");
-	}
-	spf_record->version = 1;
-	*spf_recordp = spf_record;
+	memset(&spf_c_record, 0, sizeof(spf_c_record));
 
 	/*
 	 * parse the SPF record
@@ -1400,6 +1738,7 @@ SPF_record_compile(SPF_server_t *spf_server,
 			}
 
 			if (mechtype == NULL) {
+				SPF_c_record_clear(&spf_c_record);
 				return SPF_response_add_error_ptr(spf_response,
 								SPF_E_INTERNAL_ERROR,
 								NULL, name_start,
@@ -1413,10 +1752,12 @@ SPF_record_compile(SPF_server_t *spf_server,
 
 			val_start = p;
 			err = SPF_c_mech_add(spf_server,
-							spf_record, spf_response,
+							&spf_c_record, spf_response,
 							mechtype, prefix, &val_start);
-			if (err == SPF_E_NO_MEMORY)
+			if (err == SPF_E_NO_MEMORY) {
+				SPF_c_record_clear(&spf_c_record);
 				return err;
+			}
 			/* XXX Else do nothing. Continue for the next error. */
 			/* We shouldn't have to worry about the child function
 			 * updating the pointer. So we just use our 'well known'
@@ -1454,10 +1795,12 @@ SPF_record_compile(SPF_server_t *spf_server,
 			p++;
 			val_start = p;
 			err = SPF_c_mod_add(spf_server,
-							spf_record, spf_response,
+							&spf_c_record, spf_response,
 							name_start, name_len, &val_start);
-			if (err == SPF_E_NO_MEMORY)
+			if (err == SPF_E_NO_MEMORY) {
+				SPF_c_record_clear(&spf_c_record);
 				return err;
+			}
 			/* XXX Else do nothing. Continue for the next error. */
 			p = val_end;
 			break;
@@ -1471,19 +1814,30 @@ SPF_record_compile(SPF_server_t *spf_server,
 			break;
 		}
 	}
-	
+
+
+	/*
+	 * pack the record into its final form
+	 */
+	err = SPF_c_record_finalize(&spf_c_record, &spf_record);
+	if (err != SPF_E_SUCCESS)
+		return SPF_response_add_error_ptr(spf_response, err,
+						NULL, NULL,
+						"Failed to allocate an SPF record");
+	*spf_recordp = spf_record;
 
 	/*
 	 * check for common mistakes
 	 */
-	SPF_record_lint(spf_server, spf_response, spf_record);
+	if (spf_server->compile_mode == SPF_COMPILE_DIAGNOSTIC)
+		SPF_record_lint(spf_server, spf_response, spf_record);
 
 
 	/*
 	 * do final cleanup on the record
 	 */
 
-	/* FIXME realloc (shrink) spfi buffers? */
+	spf_record->local_policy_idx = SPF_record_local_policy_idx(spf_record);
 
 	if (SPF_response_errors(spf_response) > 0) {
 		for (i = 0; i < SPF_response_messages(spf_response); i++) {
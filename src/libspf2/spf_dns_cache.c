@@ -338,7 +338,8 @@ SPF_dns_cache_rr_fixup(SPF_dns_cache_config_t *spfhook,
 	}
 
     /* set up the ttl values */
-    if ( cached_rr->ttl < spfhook->min_ttl )
+    if ( cached_rr->ttl == SPF_DNS_TTL_NONE
+			|| cached_rr->ttl < spfhook->min_ttl )
 		cached_rr->ttl = spfhook->min_ttl;
 
     if ( cached_rr->ttl < spfhook->txt_ttl
@@ -316,7 +316,7 @@ SPF_dns_resolv_lookup(SPF_dns_server_t *spf_dns_server,
 								domain, rr_type, should_cache);
 			}
 			return SPF_dns_rr_new_init(spf_dns_server,
-							domain, rr_type, 0, SPF_h_errno);
+							domain, rr_type, SPF_DNS_TTL_NONE, SPF_h_errno);
 		}
 		else if (dns_len > responselen) {
 			void	*tmp;
@@ -327,7 +327,7 @@ SPF_dns_resolv_lookup(SPF_dns_server_t *spf_dns_server,
 			if (responselen > 1048576) {	/* One megabyte. */
 				free(responsebuf);
 				return SPF_dns_rr_new_init(spf_dns_server,
-								domain, rr_type, 0, SPF_h_errno);
+								domain, rr_type, SPF_DNS_TTL_NONE, SPF_h_errno);
 			}
 #endif
 			tmp = realloc(responsebuf, responselen);
@@ -350,7 +350,7 @@ SPF_dns_resolv_lookup(SPF_dns_server_t *spf_dns_server,
 	 * initialize stuff
 	 */
 	spfrr = SPF_dns_rr_new_init(spf_dns_server,
-					domain, rr_type, 0, NETDB_SUCCESS);
+					domain, rr_type, SPF_DNS_TTL_NONE, NETDB_SUCCESS);
 	if (!spfrr) {
 		free(responsebuf);
 		return NULL;
@@ -438,6 +438,12 @@ SPF_dns_resolv_lookup(SPF_dns_server_t *spf_dns_server,
 				continue;
 			}
 
+			/* The answer is only as fresh as the shortest-lived
+			 * record in the chain, CNAMEs included. */
+			if (spfrr->ttl == SPF_DNS_TTL_NONE
+					|| (time_t)ns_rr_ttl(rr) < spfrr->ttl)
+				spfrr->ttl = ns_rr_ttl(rr);
+
 			switch (ns_rr_type(rr)) {
 				case ns_t_a:
 					if (rdlen != 4) {
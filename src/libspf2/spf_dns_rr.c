@@ -54,7 +54,7 @@ SPF_dns_rr_new_nxdomain(SPF_dns_server_t *spf_dns_server,
 				const char *domain)
 {
 	return SPF_dns_rr_new_init(spf_dns_server,
-					domain, ns_t_any, 0, HOST_NOT_FOUND);
+					domain, ns_t_any, SPF_DNS_TTL_NONE, HOST_NOT_FOUND);
 }
 
 SPF_dns_rr_t *
@@ -103,7 +103,7 @@ SPF_dns_rr_new()
 	spfrr->domain_buf_len = 0;
 	spfrr->rr_type = ns_t_invalid;
 	spfrr->num_rr = 0;
-	spfrr->ttl = 0;
+	spfrr->ttl = SPF_DNS_TTL_NONE;
 	spfrr->utc_ttl = 0;
 	spfrr->herrno = HOST_NOT_FOUND;
 
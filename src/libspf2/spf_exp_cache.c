@@ -0,0 +1,400 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either:
+ *
+ *   a) The GNU Lesser General Public License as published by the Free
+ *      Software Foundation; either version 2.1, or (at your option) any
+ *      later version,
+ *
+ *   OR
+ *
+ *   b) The two-clause BSD license.
+ *
+ * These licenses can be found with the distribution in the file LICENSES
+ */
+
+#include "spf_sys_config.h"
+
+#ifdef STDC_HEADERS
+# include <stdio.h>        /* stdin / stdout */
+# include <stdlib.h>       /* malloc / free */
+# include <ctype.h>        /* isupper / tolower */
+#endif
+
+#ifdef HAVE_NETDB_H
+# include <netdb.h>
+#endif
+
+#ifdef HAVE_STRING_H
+# include <string.h>       /* strstr / strdup */
+#else
+# ifdef HAVE_STRINGS_H
+#  include <strings.h>       /* strstr / strdup */
+# endif
+#endif
+
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "spf.h"
+#include "spf_dns.h"
+#include "spf_internal.h"
+
+
+/**
+ * @file
+ *
+ * A cache of explanations fetched with exp=, sitting between
+ * SPF_request_get_exp() and the TXT lookup.
+ *
+ * An entry is keyed by the exp domain, and holds the explanation as
+ * compiled by SPF_record_compile_macro(), so a hit costs neither a
+ * DNS lookup nor a compilation. If the explanation refers to no
+ * variable other than %{r}, its expansion is the same for every
+ * request, so the expanded text is kept as well and a hit is a copy.
+ *
+ * Entries expire with the TTL of the TXT answer, capped at max_ttl.
+ * Answers without a TTL, and failed lookups, are not cached.
+ */
+
+
+/** The longest a hash chain may grow before its oldest entries go. */
+#define SPF_EXP_CACHE_CHAIN	4
+
+/** Variables an expanded explanation may use and still be kept. */
+#define SPF_EXP_CACHE_TEXT_VARS		SPF_VAR_BIT(PARM_REC_DOM)
+
+typedef
+struct _SPF_exp_cache_bucket_t {
+	struct _SPF_exp_cache_bucket_t	*next;
+	unsigned int	 hash;
+	time_t			 utc_ttl;
+
+	char			*domain;
+	SPF_macro_t		*spf_macro;
+	unsigned int	 var_mask;
+	char			*text;		/**< The expansion, or NULL. */
+} SPF_exp_cache_bucket_t;
+
+struct SPF_exp_cache_struct {
+	SPF_exp_cache_bucket_t	**cache;
+	int						  cache_size;
+	pthread_mutex_t			  cache_lock;
+	time_t					  max_ttl;
+	unsigned long			  hits;
+	unsigned long			  misses;
+};
+
+
+/* Domains are compared case-insensitively, so hash them that way. */
+static unsigned int
+SPF_exp_cache_hash(const char *domain)
+{
+	const unsigned char	*p;
+	unsigned int		 h;
+
+	h = 5381;
+	for (p = (const unsigned char *)domain; *p; p++)
+		h = h * 33 + tolower(*p);
+	return h;
+}
+
+static size_t
+SPF_exp_cache_macro_size(SPF_macro_t *spf_macro)
+{
+	return sizeof(SPF_macro_t) + SPF_macro_data_len(spf_macro);
+}
+
+static void
+SPF_exp_cache_bucket_free(SPF_exp_cache_bucket_t *bucket)
+{
+	if (bucket->domain)
+		free(bucket->domain);
+	if (bucket->spf_macro)
+		free(bucket->spf_macro);
+	if (bucket->text)
+		free(bucket->text);
+	free(bucket);
+}
+
+/* This must be called with the lock held. */
+static void
+SPF_exp_cache_clear(SPF_exp_cache_t *cache)
+{
+	SPF_exp_cache_bucket_t	*bucket;
+	SPF_exp_cache_bucket_t	*prev;
+	int						 i;
+
+	for (i = 0; i < cache->cache_size; i++) {
+		bucket = cache->cache[i];
+		while (bucket != NULL) {
+			prev = bucket;
+			bucket = bucket->next;
+			SPF_exp_cache_bucket_free(prev);
+		}
+		cache->cache[i] = NULL;
+	}
+}
+
+SPF_exp_cache_t *
+SPF_exp_cache_new(int cache_bits, time_t max_ttl)
+{
+	SPF_exp_cache_t	*cache;
+
+	cache = (SPF_exp_cache_t *)malloc(sizeof(SPF_exp_cache_t));
+	if (cache == NULL)
+		return NULL;
+	memset(cache, 0, sizeof(SPF_exp_cache_t));
+
+	cache->cache_size = 1 << cache_bits;
+	cache->max_ttl = max_ttl;
+	cache->cache = calloc(cache->cache_size, sizeof(*cache->cache));
+	if (cache->cache == NULL) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&(cache->cache_lock), NULL);
+
+	return cache;
+}
+
+void
+SPF_exp_cache_free(SPF_exp_cache_t *cache)
+{
+	SPF_ASSERT_NOTNULL(cache);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+	SPF_exp_cache_clear(cache);
+	free(cache->cache);
+	cache->cache = NULL;
+	pthread_mutex_unlock(&(cache->cache_lock));
+
+	pthread_mutex_destroy(&(cache->cache_lock));
+	free(cache);
+}
+
+void
+SPF_exp_cache_flush(SPF_exp_cache_t *cache)
+{
+	SPF_ASSERT_NOTNULL(cache);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+	SPF_exp_cache_clear(cache);
+	pthread_mutex_unlock(&(cache->cache_lock));
+}
+
+void
+SPF_exp_cache_stats(SPF_exp_cache_t *cache, unsigned long *hitsp,
+				unsigned long *missesp)
+{
+	SPF_ASSERT_NOTNULL(cache);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+	*hitsp = cache->hits;
+	*missesp = cache->misses;
+	pthread_mutex_unlock(&(cache->cache_lock));
+}
+
+/**
+ * Looks up the explanation published at domain.
+ *
+ * On a hit, returns TRUE and notes the remaining life of the entry in
+ * spf_response. If the expanded text was cached, it is copied into
+ * *bufp and *spf_macrop is set to NULL; otherwise *spf_macrop is set
+ * to a private copy of the compiled explanation, which the caller
+ * must expand and free with SPF_macro_free().
+ */
+int
+SPF_exp_cache_find(SPF_exp_cache_t *cache,
+				SPF_response_t *spf_response,
+				const char *domain,
+				SPF_macro_t **spf_macrop,
+				char **bufp, size_t *buflenp)
+{
+	SPF_exp_cache_bucket_t	*bucket;
+	SPF_exp_cache_bucket_t	*prev;
+	SPF_macro_t				*spf_macro;
+	unsigned int			 hash;
+	size_t					 len;
+	time_t					 now;
+	time_t					 ttl;
+	int						 idx;
+
+	SPF_ASSERT_NOTNULL(cache);
+	SPF_ASSERT_NOTNULL(spf_response);
+	SPF_ASSERT_NOTNULL(domain);
+	SPF_ASSERT_NOTNULL(spf_macrop);
+	SPF_ASSERT_NOTNULL(bufp);
+	SPF_ASSERT_NOTNULL(buflenp);
+
+	*spf_macrop = NULL;
+
+	hash = SPF_exp_cache_hash(domain);
+	idx = hash & (cache->cache_size - 1);
+	time(&now);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+
+	prev = NULL;
+	bucket = cache->cache[idx];
+	while (bucket != NULL) {
+		if (bucket->utc_ttl < now) {
+			if (prev != NULL)
+				prev->next = bucket->next;
+			else
+				cache->cache[idx] = bucket->next;
+			SPF_exp_cache_bucket_free(bucket);
+			bucket = (prev != NULL) ? prev->next : cache->cache[idx];
+			continue;
+		}
+		if (bucket->hash == hash
+				&& strcasecmp(bucket->domain, domain) == 0)
+			break;
+		prev = bucket;
+		bucket = bucket->next;
+	}
+
+	if (bucket == NULL) {
+		cache->misses++;
+		pthread_mutex_unlock(&(cache->cache_lock));
+		return FALSE;
+	}
+	cache->hits++;
+
+	/* Copy out everything we need while we hold the lock. */
+	ttl = bucket->utc_ttl - now;
+	if (bucket->text != NULL) {
+		len = strlen(bucket->text) + 1;
+		if (*buflenp < len) {
+			char	*tmp = realloc(*bufp, len);
+			if (tmp == NULL) {
+				pthread_mutex_unlock(&(cache->cache_lock));
+				return FALSE;
+			}
+			*bufp = tmp;
+			*buflenp = len;
+		}
+		memcpy(*bufp, bucket->text, len);
+		spf_response->var_mask |= bucket->var_mask;
+	}
+	else {
+		len = SPF_exp_cache_macro_size(bucket->spf_macro);
+		spf_macro = (SPF_macro_t *)malloc(len);
+		if (spf_macro == NULL) {
+			pthread_mutex_unlock(&(cache->cache_lock));
+			return FALSE;
+		}
+		memcpy(spf_macro, bucket->spf_macro, len);
+		*spf_macrop = spf_macro;
+	}
+
+	pthread_mutex_unlock(&(cache->cache_lock));
+
+	SPF_response_limit_ttl(spf_response, ttl);
+	return TRUE;
+}
+
+/**
+ * Stores the explanation compiled from the TXT answer rr for domain.
+ * text is its expansion for the current request; it is kept only if
+ * it could not differ for another request.
+ */
+SPF_errcode_t
+SPF_exp_cache_add(SPF_exp_cache_t *cache,
+				const char *domain,
+				SPF_dns_rr_t *rr,
+				SPF_macro_t *spf_macro,
+				const char *text)
+{
+	SPF_exp_cache_bucket_t	*bucket;
+	SPF_exp_cache_bucket_t	*prev;
+	SPF_exp_cache_bucket_t	*next;
+	size_t					 len;
+	time_t					 ttl;
+	time_t					 now;
+	int						 idx;
+	int						 i;
+
+	SPF_ASSERT_NOTNULL(cache);
+	SPF_ASSERT_NOTNULL(domain);
+	SPF_ASSERT_NOTNULL(rr);
+	SPF_ASSERT_NOTNULL(spf_macro);
+
+	if (rr->herrno != NETDB_SUCCESS)
+		return SPF_E_SUCCESS;
+
+	time(&now);
+	/* A cached answer has already used up some of its life. */
+	if (rr->utc_ttl != 0)
+		ttl = rr->utc_ttl - now;
+	else
+		ttl = rr->ttl;
+	if (ttl > cache->max_ttl)
+		ttl = cache->max_ttl;
+	if (ttl <= 0)
+		return SPF_E_SUCCESS;
+
+	bucket = (SPF_exp_cache_bucket_t *)
+				malloc(sizeof(SPF_exp_cache_bucket_t));
+	if (bucket == NULL)
+		return SPF_E_NO_MEMORY;
+	memset(bucket, 0, sizeof(SPF_exp_cache_bucket_t));
+
+	bucket->hash = SPF_exp_cache_hash(domain);
+	bucket->utc_ttl = now + ttl;
+	bucket->domain = strdup(domain);
+	if (bucket->domain == NULL)
+		goto fail;
+	len = SPF_exp_cache_macro_size(spf_macro);
+	bucket->spf_macro = (SPF_macro_t *)malloc(len);
+	if (bucket->spf_macro == NULL)
+		goto fail;
+	memcpy(bucket->spf_macro, spf_macro, len);
+	bucket->var_mask = SPF_data_var_mask(SPF_macro_data(spf_macro),
+					SPF_macro_data_len(spf_macro));
+	if (text != NULL
+			&& (bucket->var_mask & ~SPF_EXP_CACHE_TEXT_VARS) == 0) {
+		bucket->text = strdup(text);
+		if (bucket->text == NULL)
+			goto fail;
+	}
+
+	idx = bucket->hash & (cache->cache_size - 1);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+	bucket->next = cache->cache[idx];
+	cache->cache[idx] = bucket;
+	/* Two threads may miss on the same domain; the newest copy wins. */
+	for (i = 1, prev = bucket; prev->next != NULL; i++) {
+		next = prev->next;
+		if (i >= SPF_EXP_CACHE_CHAIN
+				|| next->utc_ttl < now
+				|| (next->hash == bucket->hash
+					&& strcasecmp(next->domain, domain) == 0)) {
+			prev->next = next->next;
+			SPF_exp_cache_bucket_free(next);
+		}
+		else
+			prev = next;
+	}
+	pthread_mutex_unlock(&(cache->cache_lock));
+
+	return SPF_E_SUCCESS;
+
+fail:
+	SPF_exp_cache_bucket_free(bucket);
+	return SPF_E_NO_MEMORY;
+}
@@ -72,10 +72,134 @@ SPF_delim_valid(SPF_data_t *d, char c)
 			|| ( d->dv.delim_under && c == '_' ) );
 }
 
+static const char		hex_digits[] = "0123456789abcdef";
+
+/**
+ * Makes room for len more bytes, plus a terminating '\0', at *pp in
+ * the buffer *bufp. *pp is moved along with the buffer.
+ */
+static SPF_errcode_t
+SPF_expand_reserve(char **bufp, size_t *buflenp, char **pp, size_t len)
+{
+	size_t		 off;
+	size_t		 buflen;
+	char		*buf;
+
+	off = *pp - *bufp;
+	if (off + len < *buflenp)
+		return SPF_E_SUCCESS;
+
+	buflen = *buflenp < 32 ? 64 : *buflenp * 2;
+	while (buflen <= off + len)
+		buflen *= 2;
+	buf = realloc(*bufp, buflen);
+	if (buf == NULL)
+		return SPF_E_NO_MEMORY;
+	*bufp = buf;
+	*buflenp = buflen;
+	*pp = buf + off;
+	return SPF_E_SUCCESS;
+}
+
+/* Characters which need no escaping in a URI (RFC 2396 unreserved). */
+static inline int
+SPF_url_unreserved(unsigned char c)
+{
+	if (isalnum(c))
+		return TRUE;
+	switch (c) {
+		case '-': case '_': case '.': case '!': case '~':
+		case '*': case '\'': case '(': case ')':
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/**
+ * Appends var to the output at p, transformed as d asks: reversed
+ * and with its delimiters replaced by '.', truncated to its rightmost
+ * labels, and URL-encoded. Each step works in place in the output,
+ * which has already room for len bytes. Returns the new end.
+ */
+static char *
+SPF_expand_var(SPF_data_t *d, const char *var, size_t len, char *p)
+{
+	const char	*p_read;
+	const char	*p_read_end;
+	char		*p_write;
+	size_t		 label_len;
+	int			 num_found;
+
+	/* Copy, reversing the labels if asked. */
+	if (d->dv.rev) {
+		p_read_end = var + len;
+		p_write = p;
+		for (p_read = p_read_end; p_read > var; p_read--) {
+			if (SPF_delim_valid(d, p_read[-1])) {
+				label_len = p_read_end - p_read;
+				memcpy(p_write, p_read, label_len);
+				p_write += label_len;
+				*p_write++ = '.';
+				p_read_end = p_read - 1;
+			}
+		}
+		label_len = p_read_end - var;
+		memcpy(p_write, var, label_len);
+	}
+	else {
+		for (p_read = var, p_write = p; p_read < var + len; p_read++)
+			*p_write++ = SPF_delim_valid(d, *p_read) ? '.' : *p_read;
+	}
+
+	/* Keep only the rightmost num_rhs labels. */
+	if (d->dv.num_rhs > 0) {
+		num_found = 0;
+		for (p_write = p + len; p_write > p; p_write--) {
+			if (p_write[-1] == '.' && ++num_found == d->dv.num_rhs)
+				break;
+		}
+		if (p_write > p) {
+			len -= p_write - p;
+			memmove(p, p_write, len);
+		}
+	}
+
+	/* URL encode, from the right, so that nothing is overwritten
+	 * before it is read. Room for this was reserved by the caller. */
+	if (d->dv.url_encode) {
+		num_found = 0;
+		for (p_write = p; p_write < p + len; p_write++)
+			if (!SPF_url_unreserved((unsigned char)*p_write))
+				num_found++;
+		if (num_found > 0) {
+			p_read = p + len;
+			p_write = p + len + 2 * num_found;
+			len += 2 * num_found;
+			while (p_read > p) {
+				p_read--;
+				if (SPF_url_unreserved((unsigned char)*p_read))
+					*--p_write = *p_read;
+				else {
+					*--p_write = hex_digits[(unsigned char)*p_read & 0xf];
+					*--p_write = hex_digits[(unsigned char)*p_read >> 4];
+					*--p_write = '%';
+				}
+			}
+		}
+	}
+
+	return p + len;
+}
+
 /**
  * This could better collect errors, like the compiler does.
- * This requires that *bufp be either malloced to *buflenp, or NULL
- * This may realloc *bufp.
+ * This requires that *bufp be either malloced to *buflenp, or NULL.
+ * This may realloc *bufp; a buffer which is reused between calls
+ * soon stops growing.
+ *
+ * The expansion is written in a single pass: each variable is copied
+ * straight into *bufp and transformed there.
  */
 SPF_errcode_t
 SPF_record_expand_data(SPF_server_t *spf_server,
@@ -86,31 +210,10 @@ SPF_record_expand_data(SPF_server_t *spf_server,
 {
 	SPF_data_t	*d, *data_end;
 
-	size_t		 len, label_len;
-	const char	*p_err;	// XXX Check this value, when returned.
-	char		*p, *p_end;
-	const char	*p_read;
-	const char	*p_read_end;
-	char		*p_write;
-	char		*p2, *p2_end;
-
+	size_t		 len;
+	char		*p;
 
 	const char	*var;
-	char		*munged_var = NULL;
-	char		*url_var = NULL;
-
-			/* Pretty-printing buffers. */
-	char		ip4_buf[ INET_ADDRSTRLEN ];
-	char		ip6_buf[ INET6_ADDRSTRLEN ];
-			/* Hex buffer for ipv6 (size in nibbles) */
-	char		ip6_rbuf[ sizeof( struct in6_addr ) * 4 + 1 ];
-
-	char		time_buf[ sizeof( "4294967296" ) ]; /* 2^32 seconds max		*/
-
-	int			num_found;
-	int			i;
-	size_t		buflen;
-	int			compute_length;
 	SPF_errcode_t	 err;
 
 
@@ -122,18 +225,14 @@ SPF_record_expand_data(SPF_server_t *spf_server,
 	SPF_ASSERT_NOTNULL(bufp);
 	SPF_ASSERT_NOTNULL(buflenp);
 
-	buflen = 1;	/* For the terminating '\0' */
-	compute_length = 1;
-	p = NULL;
-	p_end = NULL;
+	p = *bufp;
+	err = SPF_expand_reserve(bufp, buflenp, &p, 0);
+	if (err != SPF_E_SUCCESS)
+		return err;
 
 	/* data_end = SPF_mech_end_data( mech ); */ /* doesn't work for mods */
 	data_end = (SPF_data_t *)((char *)data + data_len);
 
-top:
-#ifdef DEBUG
-	fprintf(stderr, "Pass start compute_length=%d\n", compute_length);
-#endif
 	/*
 	 * expand the data
 	 */
@@ -145,14 +244,9 @@ top:
 			continue;
 
 		if (d->ds.parm_type == PARM_STRING) {
-			if (compute_length) {
-				buflen += d->ds.len;
-				continue;
-			}
-			/* This should NEVER happen now. */
-			if (p_end - (p + d->ds.len) <= 0)
-					SPF_error("Failed to allocate enough memory "
-								"to expand string.");
+			err = SPF_expand_reserve(bufp, buflenp, &p, d->ds.len);
+			if (err != SPF_E_SUCCESS)
+				return err;
 			memcpy(p, SPF_data_str(d), d->ds.len);
 			p += d->ds.len;
 			continue;
@@ -160,6 +254,10 @@ top:
 
 		/* Otherwise, it's a variable. */
 
+		/* The result cache needs to know what this answer read. */
+		if (spf_response != NULL)
+			spf_response->var_mask |= 1U << d->dv.parm_type;
+
 		var = NULL;
 		switch (d->dv.parm_type) {
 		case PARM_LP_FROM:		/* local-part of envelope-sender */
@@ -179,65 +277,15 @@ top:
 			break;
 
 		case PARM_CLIENT_IP:		/* SMTP client IP				*/
-			if (compute_length) {
-				len = sizeof(ip6_rbuf);
-				if (d->dv.url_encode)
-					len *= 3;
-				buflen += len;
-				continue;
-			}
-			if (spf_request->client_ver == AF_INET) {
-				p_err = inet_ntop(AF_INET, &spf_request->ipv4,
-								   ip4_buf, sizeof(ip4_buf));
-				var = ip4_buf;
-			}
-			else if (spf_request->client_ver == AF_INET6) {
-				p2 = ip6_rbuf;
-				p2_end = p2 + sizeof(ip6_rbuf);
-
-				for (i = 0; i < array_elem(spf_request->ipv6.s6_addr); i++) {
-					p2 += snprintf(p2, p2_end - p2, "%.1x.%.1x.",
-									spf_request->ipv6.s6_addr[i] >> 4,
-									spf_request->ipv6.s6_addr[i] & 0xf);
-				}
-
-				/* squash the final '.' */
-				ip6_rbuf[sizeof(struct in6_addr) * 4 - 1] = '\0';
-
-				var = ip6_rbuf;
-			}
+			var = SPF_request_get_client_ip(spf_request);
 			break;
 
 		case PARM_CLIENT_IP_P:		/* SMTP client IP (pretty)		*/
-			if (compute_length) {
-				len = sizeof(ip6_rbuf);
-				if (d->dv.url_encode)
-					len *= 3;
-				buflen += len;
-				continue;
-			}
-			if (spf_request->client_ver == AF_INET) {
-				p_err = inet_ntop(AF_INET, &spf_request->ipv4,
-								   ip4_buf, sizeof(ip4_buf));
-				var = ip4_buf;
-			}
-			else if (spf_request->client_ver == AF_INET6) {
-				p_err = inet_ntop(AF_INET6, &spf_request->ipv6,
-								   ip6_buf, sizeof(ip6_buf));
-				var = ip6_buf;
-			}
+			var = SPF_request_get_client_ip_p(spf_request);
 			break;
 
 		case PARM_TIME:				/* time in UTC epoch secs		*/
-			if (compute_length) {
-				len = sizeof(time_buf);
-				/* This never gets bigger using URL encoding. */
-				buflen += len;
-				continue;
-			}
-			snprintf(time_buf, sizeof(time_buf), "%ld",
-					  (long)time(NULL));
-			var = time_buf;
+			var = SPF_request_get_time(spf_request);
 			break;
 
 		case PARM_CLIENT_DOM:		/* SMTP client domain name		*/
@@ -273,179 +321,14 @@ top:
 			return SPF_E_UNINIT_VAR;
 
 		len = strlen(var);
-		if (compute_length) {
-			if (d->dv.url_encode)
-				len *= 3;
-			buflen += len;
-			continue;
-		}
-
-		/* Now we put 'var' through the munging procedure. */
-		munged_var = (char *)malloc(len + 1);
-		if (munged_var == NULL)
-			return SPF_E_NO_MEMORY;
-		memset(munged_var, 0, len + 1);
-
-		p_read_end = var + len;
-		p_write = munged_var;
-
-		/* reverse */
-
-/* The following code confuses both me and Coverity. Shevek. */
-
-		if (d->dv.rev) {
-			p_read = p_read_end - 1;
-
-			while ( p_read >= var ) {
-				if ( SPF_delim_valid(d, *p_read) ) {
-					/* Subtract 1 because p_read points to delim, and
-					 * p_read_end points to the following delim. */
-					label_len = p_read_end - p_read - 1;
-					memcpy( p_write, p_read + 1, label_len );
-					p_write += label_len;
-					*p_write++ = '.';
-
-					p_read_end = p_read;
-				}
-				p_read--;
-			}
-
-			/* Now p_read_end should point one before the start of the
-			 * string. p_read_end might also point there if the string
-			 * starts with a delimiter. */
-			if (p_read_end >= p_read) {
-				label_len = p_read_end - p_read - 1;
-				memcpy( p_write, p_read + 1, label_len );
-				p_write += label_len;
-				*p_write++ = '.';
-			}
-
-			/* p_write always points to the 'next' character. */
-			p_write--;
-			*p_write = '\0';
-		}
-		else {
-			p_read = var;
-
-			while (p_read < p_read_end) {
-				if (SPF_delim_valid(d, *p_read))
-					*p_write++ = '.';
-				else
-					*p_write++ = *p_read;
-				p_read++;
-			}
-
-			*p_write = '\0';
-		}
-
-		/* Now munged_var is a copy of var, possibly reversed, and
-		 * thus len == strlen(munged_var). However, we continue to
-		 * manipulate the underlying munged_var since var is const. */
-
-		/* truncate, from the right hand side. */
-		if (d->dv.num_rhs > 0) {
-			p_read_end = munged_var + len;		/* const, at '\0' */
-			p_write = munged_var + len - 1;
-			num_found = 0;
-			while (p_write > munged_var) {
-				if (*p_write == '.')
-					num_found++;
-				if (num_found == d->dv.num_rhs)
-					break;
-				p_write--;
-			}
-			p_write++;		/* Move to just after the '.' */
-			/* This moves the '\0' as well. */
-			len = p_read_end - p_write;
-			memmove(munged_var, p_write, len + 1);
-		}
-
-		var = munged_var;
-		/* Now, we have 'var', of length 'len' */
-
-		/* URL encode */
-
-		if (d->dv.url_encode) {
-			url_var = malloc(len * 3 + 1);
-			if (url_var == NULL) {
-				if (munged_var)
-					free(munged_var);
-				return SPF_E_NO_MEMORY;
-			}
-
-			p_read = var;
-			p_write = url_var;
-
-			/* escape non-uric characters (rfc2396) */
-			while ( *p_read != '\0' )
-			{
-				if ( isalnum( (unsigned char)( *p_read  ) ) )
-					*p_write++ = *p_read++;
-				else
-				{
-					switch( *p_read )
-					{
-					case '-':
-					case '_':
-					case '.':
-					case '!':
-					case '~':
-					case '*':
-					case '\'':
-					case '(':
-					case ')':
-						*p_write++ = *p_read++;
-						break;
-
-					default:
-						snprintf( p_write, 4, "%%%02x", (unsigned char) *p_read );
-						p_write += 3;
-						p_read++;
-						break;
-					}
-				}
-			}
-			*p_write = '\0';
-
-			var = url_var;
-			len = p_write - url_var;		/* Not actually used. */
-		}
-
-
-		/* finish up */
-		len = snprintf(p, p_end - p, "%s", var);
-		p += len;
-		if (p_end - p <= 0) {
-			if (munged_var)
-				free(munged_var);
-			if (url_var)
-				free(url_var);
-			return SPF_E_INTERNAL_ERROR;
-		}
-
-		if (munged_var)
-			free(munged_var);
-		munged_var = NULL;
-		if (url_var)
-			free(url_var);
-		url_var = NULL;
-	}
-#ifdef DEBUG
-	fprintf(stderr, "Pass end compute_length=%d\n", compute_length);
-#endif
-
-	if (compute_length) {
-		compute_length = 0;
-		/* Do something about (re-)allocating the buffer. */
-		err = SPF_recalloc(bufp, buflenp, buflen);
+		err = SPF_expand_reserve(bufp, buflenp, &p,
+						d->dv.url_encode ? len * 3 : len);
 		if (err != SPF_E_SUCCESS)
 			return err;
-		p = *bufp;
-		p_end = *bufp + *buflenp;
-		goto top;
+		p = SPF_expand_var(d, var, len, p);
 	}
 
-	*p++ = '\0';
+	*p = '\0';
 
 	return SPF_E_SUCCESS;
 }
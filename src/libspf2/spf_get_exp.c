@@ -75,6 +75,8 @@ SPF_server_get_default_explanation(SPF_server_t *spf_server,
 }
 
 #define RETURN_DEFAULT_EXP() do { \
+		if (exp_dom != NULL) \
+			free(exp_dom); \
 		return SPF_server_get_default_explanation(spf_server, \
 						spf_request, spf_response, bufp, buflenp); \
 				} while(0)
@@ -91,6 +93,7 @@ SPF_request_get_exp(SPF_server_t *spf_server,
 	SPF_dns_rr_t		*rr_txt;
 	SPF_errcode_t		 err;
 	const char			*domain;
+	char				*exp_dom;
 
 
 	/*
@@ -105,6 +108,7 @@ SPF_request_get_exp(SPF_server_t *spf_server,
 	SPF_ASSERT_NOTNULL(bufp);
 	SPF_ASSERT_NOTNULL(buflenp);
 
+	exp_dom = NULL;
 	domain = spf_request->cur_dom;
 
 	if ( domain == NULL )
@@ -115,9 +119,9 @@ SPF_request_get_exp(SPF_server_t *spf_server,
 	 * start looking...  check spfid for exp-text=
 	 */
 
-	err = SPF_record_find_mod_value(spf_server, spf_request,
+	err = SPF_record_get_mod_value(spf_server, spf_request,
 					spf_response, spf_record,
-					SPF_EXP_MOD_NAME, bufp, buflenp);
+					SPF_MOD_KNOWN_EXP_TEXT, bufp, buflenp);
 	if (err == SPF_E_SUCCESS)
 		return err;
 
@@ -126,9 +130,9 @@ SPF_request_get_exp(SPF_server_t *spf_server,
 	 * still looking...  check the spfid for exp=
 	 */
 
-	err = SPF_record_find_mod_value(spf_server, spf_request,
+	err = SPF_record_get_mod_value(spf_server, spf_request,
 					spf_response, spf_record,
-					"exp", bufp, buflenp );
+					SPF_MOD_KNOWN_EXP, bufp, buflenp);
 	if (err != SPF_E_SUCCESS) {
 		/*
 		 * still looking...  try to return default exp from spfcid
@@ -155,11 +159,29 @@ SPF_request_get_exp(SPF_server_t *spf_server,
 	if (resolver->get_exp)
 		return resolver->get_exp(spf_server, *bufp, bufp, buflenp);
 
+	if (spf_server->exp_cache != NULL
+			&& SPF_exp_cache_find(spf_server->exp_cache, spf_response,
+					*bufp, &spf_macro, bufp, buflenp)) {
+		if (spf_macro == NULL)
+			return SPF_E_SUCCESS;
+		err = SPF_record_expand_data(spf_server,
+						spf_request, spf_response,
+						SPF_macro_data(spf_macro), spf_macro->macro_len,
+						bufp, buflenp);
+		SPF_macro_free(spf_macro);
+		return err;
+	}
+
+	/* The expansion below overwrites the exp domain in *bufp. */
+	if (spf_server->exp_cache != NULL)
+		exp_dom = strdup(*bufp);
+
 	rr_txt = SPF_dns_lookup(resolver, *bufp, ns_t_txt, TRUE);
 	if (rr_txt == NULL) {
 		SPF_dns_rr_free(rr_txt);
 		RETURN_DEFAULT_EXP();
 	}
+	SPF_response_add_ttl(spf_response, rr_txt);
 
 	switch (rr_txt->herrno) {
 		case HOST_NOT_FOUND:
@@ -211,6 +233,13 @@ SPF_request_get_exp(SPF_server_t *spf_server,
 					spf_request, spf_response,
 					SPF_macro_data(spf_macro), spf_macro->macro_len,
 					bufp, buflenp);
+	if (exp_dom != NULL) {
+		/* A cache which cannot grow costs us nothing but speed. */
+		SPF_exp_cache_add(spf_server->exp_cache, exp_dom, rr_txt,
+						spf_macro,
+						err == SPF_E_SUCCESS ? *bufp : NULL);
+		free(exp_dom);
+	}
 	SPF_macro_free(spf_macro);
 	SPF_dns_rr_free(rr_txt);
 
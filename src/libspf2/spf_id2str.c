@@ -260,7 +260,8 @@ SPF_record_stringify( SPF_record_t *spf_record, char **bufp, size_t *buflenp)
 	int				cidr_ok;
 	SPF_errcode_t	err;
 	
-#define debug spf_record->spf_server->debug
+/* A record has no server to take a debug level from, so tracing is off. */
+#define debug 0
 
 	SPF_ASSERT_NOTNULL(spf_record);
 
@@ -307,7 +308,7 @@ SPF_record_stringify( SPF_record_t *spf_record, char **bufp, size_t *buflenp)
 	 * generate mechanisms
 	 */
 	
-	mech = spf_record->mech_first;
+	mech = SPF_record_mech_first(spf_record);
 	for (i = 0; i < spf_record->num_mech; i++) {
 		if (debug)
 			SPF_debugf("stringify: Handling mechanism %d/%d at %p",
@@ -443,7 +444,7 @@ SPF_record_stringify( SPF_record_t *spf_record, char **bufp, size_t *buflenp)
 	 * generate modifiers
 	 */
 
-	mod = spf_record->mod_first;
+	mod = SPF_record_mod_first(spf_record);
 	for( i = 0; i < spf_record->num_mod; i++ )
 	{
 		if (debug)
@@ -105,9 +105,15 @@ SPF_i_set_smtp_comment(SPF_response_t *spf_response)
 		case SPF_RESULT_SOFTFAIL:
 		case SPF_RESULT_NEUTRAL:
 
-			err = SPF_i_set_explanation(spf_response);
-			if (err != SPF_E_SUCCESS)
-				return err;
+			/* A response replayed from the result cache arrives
+			 * with its explanation already expanded, and with no
+			 * record to expand it from. */
+			if (spf_response->spf_record_exp != NULL
+					|| spf_response->explanation == NULL) {
+				err = SPF_i_set_explanation(spf_response);
+				if (err != SPF_E_SUCCESS)
+					return err;
+			}
 
 			memset(buf, '\0', sizeof(buf));
 			snprintf(buf, SPF_SMTP_COMMENT_SIZE, "%s : Reason: %s",
@@ -142,8 +148,6 @@ SPF_i_set_header_comment(SPF_response_t *spf_response)
 
 	size_t			 len;
 
-	char			 ip4_buf[ INET_ADDRSTRLEN ];
-	char			 ip6_buf[ INET6_ADDRSTRLEN ];
 	const char		*ip;
 
 	char			*buf;
@@ -187,15 +191,7 @@ SPF_i_set_header_comment(SPF_response_t *spf_response)
 	if ( spf_source == NULL )
 		return SPF_E_INTERNAL_ERROR;
 
-	ip = NULL;
-	if ( spf_request->client_ver == AF_INET ) {
-		ip = inet_ntop( AF_INET, &spf_request->ipv4,
-						ip4_buf, sizeof( ip4_buf ) );
-	}
-	else if (spf_request->client_ver == AF_INET6 ) {
-		ip = inet_ntop( AF_INET6, &spf_request->ipv6,
-						ip6_buf, sizeof( ip6_buf ) );
-	}
+	ip = SPF_request_get_client_ip_p(spf_request);
 	if ( ip == NULL )
 		ip = "(unknown ip address)";
 
@@ -274,8 +270,6 @@ SPF_i_set_received_spf(SPF_response_t *spf_response)
 {
 	SPF_server_t	*spf_server;
 	SPF_request_t	*spf_request;
-	char			 ip4_buf[ INET_ADDRSTRLEN ];
-	char			 ip6_buf[ INET6_ADDRSTRLEN ];
 	const char		*ip;
 
 	char			*buf;
@@ -315,15 +309,7 @@ SPF_i_set_received_spf(SPF_response_t *spf_response)
 		
 		
 		/* add in the optional ip address keyword */
-		ip = NULL;
-		if ( spf_request->client_ver == AF_INET ) {
-			ip = inet_ntop( AF_INET, &spf_request->ipv4,
-							ip4_buf, sizeof( ip4_buf ) );
-		}
-		else if (spf_request->client_ver == AF_INET6 ) {
-			ip = inet_ntop( AF_INET6, &spf_request->ipv6,
-							ip6_buf, sizeof( ip6_buf ) );
-		}
+		ip = SPF_request_get_client_ip_p(spf_request);
 
 		if ( ip != NULL ) {
 			p += snprintf( p, p_end - p, " client-ip=%s;", ip );
@@ -577,8 +563,108 @@ SPF_i_match_domain(SPF_server_t *spf_server,
 }
 
 
+/**
+ * Finds the target domain of a mechanism.
+ *
+ * A target with no macro variables compiles to a single NUL
+ * terminated string, which is used in place.  Anything else is
+ * expanded into *bufp.
+ */
+static SPF_errcode_t
+SPF_i_expand_target(SPF_server_t *spf_server,
+				SPF_request_t *spf_request,
+				SPF_response_t *spf_response,
+				unsigned int var_mask,
+				SPF_data_t *data, SPF_data_t *data_end,
+				char **bufp, size_t *buflenp,
+				const char **lookupp)
+{
+	SPF_errcode_t	 err;
+
+	if (var_mask == 0 && data < data_end
+			&& data->ds.parm_type == PARM_STRING
+			&& SPF_data_next(data) >= data_end) {
+		*lookupp = SPF_data_str(data);
+		return SPF_E_SUCCESS;
+	}
+
+	err = SPF_record_expand_data(spf_server,
+					spf_request, spf_response,
+					data, (char *)data_end - (char *)data,
+					bufp, buflenp);
+	if (err == SPF_E_SUCCESS)
+		*lookupp = *bufp;
+	return err;
+}
+
+/**
+ * One level of include/redirect nesting in SPF_record_interpret().
+ */
+typedef enum SPF_i_frame_kind_enum {
+	SPF_I_FRAME_ROOT,		/**< The record we were called with.	*/
+	SPF_I_FRAME_INCLUDE,	/**< Result is mapped by the includer.	*/
+	SPF_I_FRAME_REDIRECT,	/**< Result is the includer's result.	*/
+	SPF_I_FRAME_POLICY		/**< The local policy. Likewise.		*/
+} SPF_i_frame_kind_t;
+
+typedef
+struct SPF_i_frame_struct
+{
+	SPF_i_frame_kind_t	 kind;
+	SPF_record_t		*spf_record;	/**< Freed on pop if fetched.	*/
+	SPF_mech_t			*mech;			/**< Current mechanism...		*/
+	int					 m;				/**< ... and its index.		*/
+	int					 local_policy;	/**< Mechanism index, not the policy */
+	const char			*save_cur_dom;	/**< Restored on pop.			*/
+	char				*buf;			/**< Expanded mechanism target.	*/
+	size_t				 buf_len;
+} SPF_i_frame_t;
+
+static void
+SPF_i_frame_init(SPF_i_frame_t *frame, SPF_i_frame_kind_t kind,
+				SPF_record_t *spf_record, const char *save_cur_dom,
+				SPF_request_t *spf_request, SPF_server_t *spf_server)
+{
+	frame->kind = kind;
+	frame->spf_record = spf_record;
+	frame->mech = SPF_record_mech_first(spf_record);
+	frame->m = 0;
+	/* The compiler found the location for the whitelist execution. */
+	frame->local_policy = -1;
+	if (spf_request->use_local_policy && spf_server->local_policy)
+		frame->local_policy = spf_record->local_policy_idx;
+	frame->save_cur_dom = save_cur_dom;
+	frame->buf = NULL;
+	frame->buf_len = 0;
+}
+
+/**
+ * Discards the top frame and returns the one below it.
+ */
+static SPF_i_frame_t *
+SPF_i_frame_pop(SPF_i_frame_t *frames, int *spp,
+				SPF_request_t *spf_request)
+{
+	SPF_i_frame_t	*frame = &frames[*spp];
+
+	spf_request->cur_dom = frame->save_cur_dom;
+	if (frame->kind == SPF_I_FRAME_INCLUDE
+			|| frame->kind == SPF_I_FRAME_REDIRECT)
+		SPF_record_free(frame->spf_record);
+	if (frame->buf != NULL)
+		free(frame->buf);
+	(*spp)--;
+	return &frames[*spp];
+}
+
 /*
  * Set cur_dom (to either sender or or helo_dom) before calling this.
+ *
+ * Includes and redirects are evaluated on an explicit stack of
+ * frames, all sharing spf_response. A frame which reaches a result
+ * hands it to the frame below: an include maps it according to the
+ * include rules, a redirect or the local policy passes it on as it
+ * stands. Only the outermost result goes through SPF_i_done().
  */
 
 SPF_errcode_t
@@ -594,13 +680,19 @@ SPF_record_interpret(SPF_record_t *spf_record,
 	SPF_mech_t		*mech;
 	SPF_data_t		*data;
 	SPF_data_t		*data_end;	/* XXX Replace with size_t data_len */
+	unsigned int	 var_mask;	/* Macro variables used by mech */
+	int				 should_cache;
+
+	/* Include/redirect nesting */
+	SPF_i_frame_t	 frames[SPF_MAX_INCLUDE_DEPTH + 1];
+	SPF_i_frame_t	*frame;
+	int				 sp;		/* Index of the current frame */
+	int				 includes;	/* Number of include frames */
 
-	/* Where to insert the local policy (whitelist) */
-	SPF_mech_t		*local_policy;	/* Not the local policy */
-	int				 found_all;		/* A crappy temporary. */
+	/* The result of the current frame */
+	SPF_result_t	 result;
+	SPF_reason_t	 reason;
 
-	char			*buf = NULL;
-	size_t			 buf_len = 0;
 	ns_type			 fetch_ns_type;
 	const char		*lookup;
 
@@ -616,8 +708,6 @@ SPF_record_interpret(SPF_record_t *spf_record,
 	/* An SPF record for subrequests - replaces c_results */
 	SPF_record_t	*spf_record_subr;
 
-	SPF_response_t	*save_spf_response;
-	SPF_response_t	*spf_response_subr;
 	const char		*save_cur_dom;
 
 	struct in_addr	addr4;
@@ -637,12 +727,12 @@ SPF_record_interpret(SPF_record_t *spf_record,
 	SPF_ASSERT_NOTNULL(spf_record);
 	SPF_ASSERT_NOTNULL(spf_request);
 	SPF_ASSERT_NOTNULL(spf_response);
-	spf_server = spf_record->spf_server;
+	spf_server = spf_request->spf_server;
 	SPF_ASSERT_NOTNULL(spf_server);
 
 	SPF_ASSERT_NOTNULL(spf_response->spf_record_exp);
 
-	if (depth > 20)
+	if (depth > SPF_MAX_INCLUDE_DEPTH)
 		return DONE_PERMERR(SPF_E_RECURSIVE);
 
 	if ( spf_request->client_ver != AF_INET && spf_request->client_ver != AF_INET6 )
@@ -662,62 +752,21 @@ SPF_record_interpret(SPF_record_t *spf_record,
 		return DONE(SPF_RESULT_PASS,SPF_REASON_LOCALHOST,SPF_E_SUCCESS);
 #endif
 
-	/*
-	 * Do some start up stuff if we haven't recursed yet
-	 */
-
-	local_policy = NULL;
-
-	if ( spf_request->use_local_policy ) {
-		/*
-		 * find the location for the whitelist execution
-		 *
-		 * Philip Gladstone says:
-		 *
-		 * I think that the localpolicy should only be inserted if the
-		 * final mechanism is '-all', and it should be inserted after
-		 * the last mechanism which is not '-'.
-		 *
-		 * Thus for the case of 'v=spf1 +a +mx -all', this would be
-		 * interpreted as 'v=spf1 +a +mx +localpolicy -all'. Whereas
-		 * 'v=spf1 -all' would remain the same (no non-'-'
-		 * mechanism). 'v=spf1 +a +mx -exists:%stuff -all' would
-		 * become 'v=spf1 +a +mx +localpolicy -exists:%stuff -all'.
-		 */
-
-		if ( spf_server->local_policy ) {
-			mech = spf_record->mech_first;
-
-			found_all = FALSE;
-			for(m = 0; m < spf_record->num_mech; m++)
-			{
-				if ( mech->mech_type == MECH_ALL
-					 && (mech->prefix_type == PREFIX_FAIL
-						 || mech->prefix_type == PREFIX_UNKNOWN
-						 || mech->prefix_type == PREFIX_SOFTFAIL
-						 )
-					)
-					found_all = TRUE;
-
-				if ( mech->prefix_type != PREFIX_FAIL
-					 && mech->prefix_type != PREFIX_SOFTFAIL
-					)
-					local_policy = mech;
-
-				mech = SPF_mech_next( mech );
-			}
-
-			if ( !found_all )
-				local_policy = NULL;
-		}
-
-	}
-
 
 	/*
 	 * evaluate the mechanisms
 	 */
 
+#define SPF_I_RESULT(_result, _reason, _err) \
+	do { result = (_result); reason = (_reason); err = (_err);	\
+			goto outcome; } while(0)
+#define SPF_I_TEMPERR(_err) \
+	SPF_I_RESULT(SPF_RESULT_TEMPERROR, SPF_REASON_NONE, _err)
+#define SPF_I_PERMERR(_err) \
+	SPF_I_RESULT(SPF_RESULT_PERMERROR, SPF_REASON_NONE, _err)
+#define SPF_I_MECH(_result) \
+	SPF_I_RESULT(_result, SPF_REASON_MECH, SPF_E_SUCCESS)
+
 #define SPF_ADD_DNS_MECH() do { spf_response->num_dns_mech++; } while(0)
 
 #define SPF_MAYBE_SKIP_CIDR() \
@@ -731,39 +780,47 @@ SPF_record_interpret(SPF_record_t *spf_record,
 		if ( data == data_end )							\
 			lookup = spf_request->cur_dom;				\
 		else {											\
-			err = SPF_record_expand_data( spf_server,	\
+			err = SPF_i_expand_target( spf_server,		\
 							spf_request, spf_response,	\
-							data, ((char *)data_end - (char *)data),	\
-							&buf, &buf_len );			\
-			if (err == SPF_E_NO_MEMORY) {				\
-				SPF_FREE_LOOKUP_DATA();					\
-				return DONE_TEMPERR(err);				\
-			}											\
-			if (err) {									\
-				SPF_FREE_LOOKUP_DATA();					\
-				return DONE_PERMERR(err);				\
-			}											\
-			lookup = buf;								\
+							var_mask, data, data_end,	\
+							&frame->buf, &frame->buf_len,	\
+							&lookup );					\
+			if (err == SPF_E_NO_MEMORY)					\
+				SPF_I_TEMPERR(err);						\
+			if (err)									\
+				SPF_I_PERMERR(err);						\
 		}												\
 	} while(0)
-#define SPF_FREE_LOOKUP_DATA() \
-	do { if (buf != NULL) { free(buf); buf = NULL; } } while(0)
 
 
 	resolver = spf_server->resolver;
 
-	mech = spf_record->mech_first;
-	for (m = 0; m < spf_record->num_mech; m++) {
+	sp = 0;
+	includes = 0;
+	frame = &frames[0];
+	SPF_i_frame_init(frame, SPF_I_FRAME_ROOT, spf_record,
+					spf_request->cur_dom, spf_request, spf_server);
+
+	for (;;) {
+		spf_record = frame->spf_record;
+		mech = frame->mech;
+		m = frame->m;
+
+		if (m >= spf_record->num_mech) {
+			/* falling off the end is the same as ?all */
+			SPF_I_RESULT(SPF_RESULT_NEUTRAL, SPF_REASON_DEFAULT,
+							SPF_E_SUCCESS);
+		}
 
 		/* This is as good a place as any. */
 		/* XXX Rip this out and put it into a macro which can go into inner loops. */
-		if (spf_response->num_dns_mech > spf_server->max_dns_mech) {
-			SPF_FREE_LOOKUP_DATA();
-			return DONE(SPF_RESULT_PERMERROR, SPF_REASON_NONE, SPF_E_BIG_DNS);
-		}
+		if (spf_response->num_dns_mech > spf_server->max_dns_mech)
+			SPF_I_RESULT(SPF_RESULT_PERMERROR, SPF_REASON_NONE, SPF_E_BIG_DNS);
 
 		data = SPF_mech_data(mech);
 		data_end = SPF_mech_end_data(mech);
+		var_mask = SPF_record_mech_vars(spf_record, m);
+		should_cache = SPF_record_mech_should_cache(spf_record, m);
 
 		switch (mech->mech_type) {
 		case MECH_A:
@@ -776,7 +833,9 @@ SPF_record_interpret(SPF_record_t *spf_record,
 			else
 				fetch_ns_type = ns_t_aaaa;
 
-			rr_a = SPF_dns_lookup(resolver, lookup, fetch_ns_type, TRUE);
+			rr_a = SPF_dns_lookup(resolver, lookup, fetch_ns_type,
+							should_cache);
+			SPF_response_add_ttl(spf_response, rr_a);
 
 			if (spf_server->debug)
 				SPF_debugf("found %d A records for %s  (herrno: %d)",
@@ -784,8 +843,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 
 			if (rr_a->herrno == TRY_AGAIN) {
 				SPF_dns_rr_free(rr_a);
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_TEMPERR(SPF_E_DNS_ERROR); /* REASON_MECH */
+				SPF_I_TEMPERR(SPF_E_DNS_ERROR); /* REASON_MECH */
 			}
 
 			for (i = 0; i < rr_a->num_rr; i++) {
@@ -796,15 +854,13 @@ SPF_record_interpret(SPF_record_t *spf_record,
 				if (spf_request->client_ver == AF_INET) {
 					if (SPF_i_match_ip4(spf_server, spf_request, mech, rr_a->rr[i]->a)) {
 						SPF_dns_rr_free(rr_a);
-						SPF_FREE_LOOKUP_DATA();
-						return DONE_MECH(mech->prefix_type);
+						SPF_I_MECH(mech->prefix_type);
 					}
 				}
 				else {
 					if (SPF_i_match_ip6(spf_server, spf_request, mech, rr_a->rr[i]->aaaa)) {
 						SPF_dns_rr_free(rr_a);
-						SPF_FREE_LOOKUP_DATA();
-						return DONE_MECH(mech->prefix_type);
+						SPF_I_MECH(mech->prefix_type);
 					}
 				}
 			}
@@ -817,7 +873,8 @@ SPF_record_interpret(SPF_record_t *spf_record,
 			SPF_MAYBE_SKIP_CIDR();
 			SPF_GET_LOOKUP_DATA();
 
-			rr_mx = SPF_dns_lookup(resolver, lookup, ns_t_mx, TRUE);
+			rr_mx = SPF_dns_lookup(resolver, lookup, ns_t_mx, should_cache);
+			SPF_response_add_ttl(spf_response, rr_mx);
 
 			if (spf_server->debug)
 				SPF_debugf("found %d MX records for %s  (herrno: %d)",
@@ -825,8 +882,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 
 			if (rr_mx->herrno == TRY_AGAIN) {
 				SPF_dns_rr_free(rr_mx);
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_TEMPERR(SPF_E_DNS_ERROR);
+				SPF_I_TEMPERR(SPF_E_DNS_ERROR);
 			}
 
 			/* The maximum number of MX records we will inspect. */
@@ -849,6 +905,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 
 				rr_a = SPF_dns_lookup(resolver, rr_mx->rr[j]->mx,
 									   fetch_ns_type, TRUE );
+				SPF_response_add_ttl(spf_response, rr_a);
 
 				if (spf_server->debug)
 					SPF_debugf("%d: found %d A records for %s  (herrno: %d)",
@@ -856,8 +913,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 				if (rr_a->herrno == TRY_AGAIN) {
 					SPF_dns_rr_free(rr_mx);
 					SPF_dns_rr_free(rr_a);
-					SPF_FREE_LOOKUP_DATA();
-					return DONE_TEMPERR(SPF_E_DNS_ERROR);
+					SPF_I_TEMPERR(SPF_E_DNS_ERROR);
 				}
 
 				for (i = 0; i < rr_a->num_rr; i++) {
@@ -870,8 +926,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 										rr_a->rr[i]->a)) {
 							SPF_dns_rr_free(rr_mx);
 							SPF_dns_rr_free(rr_a);
-							SPF_FREE_LOOKUP_DATA();
-							return DONE(mech->prefix_type, SPF_REASON_MECH,
+							SPF_I_RESULT(mech->prefix_type, SPF_REASON_MECH,
 										 SPF_E_SUCCESS);
 						}
 					}
@@ -880,8 +935,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 										rr_a->rr[i]->aaaa)) {
 							SPF_dns_rr_free(rr_mx);
 							SPF_dns_rr_free(rr_a);
-							SPF_FREE_LOOKUP_DATA();
-							return DONE(mech->prefix_type, SPF_REASON_MECH,
+							SPF_I_RESULT(mech->prefix_type, SPF_REASON_MECH,
 										 SPF_E_SUCCESS);
 						}
 					}
@@ -891,8 +945,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 
 			SPF_dns_rr_free( rr_mx );
 			if (max_exceeded) {
-				SPF_FREE_LOOKUP_DATA();
-				return DONE(SPF_RESULT_PERMERROR, SPF_REASON_NONE, SPF_E_BIG_DNS);
+				SPF_I_RESULT(SPF_RESULT_PERMERROR, SPF_REASON_NONE, SPF_E_BIG_DNS);
 			}
 			break;
 
@@ -903,6 +956,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 			if (spf_request->client_ver == AF_INET) {
 				rr_ptr = SPF_dns_rlookup(resolver,
 								spf_request->ipv4, ns_t_ptr, TRUE);
+				SPF_response_add_ttl(spf_response, rr_ptr);
 
 				if (spf_server->debug) {
 					INET_NTOP(AF_INET, &spf_request->ipv4.s_addr,
@@ -913,8 +967,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 
 				if (rr_ptr->herrno == TRY_AGAIN) {
 					SPF_dns_rr_free(rr_ptr);
-					SPF_FREE_LOOKUP_DATA();
-					return DONE_TEMPERR(SPF_E_DNS_ERROR);
+					SPF_I_TEMPERR(SPF_E_DNS_ERROR);
 				}
 
 
@@ -931,6 +984,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 
 					rr_a = SPF_dns_lookup(resolver,
 							rr_ptr->rr[i]->ptr, ns_t_a, TRUE);
+					SPF_response_add_ttl(spf_response, rr_a);
 
 					if (spf_server->debug)
 						SPF_debugf( "%d:  found %d A records for %s  (herrno: %d)",
@@ -938,8 +992,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 					if (rr_a->herrno == TRY_AGAIN) {
 						SPF_dns_rr_free(rr_ptr);
 						SPF_dns_rr_free(rr_a);
-						SPF_FREE_LOOKUP_DATA();
-						return DONE_TEMPERR( SPF_E_DNS_ERROR );
+						SPF_I_TEMPERR( SPF_E_DNS_ERROR );
 					}
 
 					for (j = 0; j < rr_a->num_rr; j++) {
@@ -958,8 +1011,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 											rr_ptr->rr[i]->ptr, lookup)) {
 								SPF_dns_rr_free(rr_ptr);
 								SPF_dns_rr_free(rr_a);
-								SPF_FREE_LOOKUP_DATA();
-								return DONE_MECH(mech->prefix_type);
+								SPF_I_MECH(mech->prefix_type);
 							}
 						}
 					}
@@ -968,14 +1020,14 @@ SPF_record_interpret(SPF_record_t *spf_record,
 				SPF_dns_rr_free(rr_ptr);
 
 				if (max_exceeded) {
-					SPF_FREE_LOOKUP_DATA();
-					return DONE(SPF_RESULT_PERMERROR, SPF_REASON_NONE, SPF_E_BIG_DNS);
+					SPF_I_RESULT(SPF_RESULT_PERMERROR, SPF_REASON_NONE, SPF_E_BIG_DNS);
 				}
 			}
 
 			else if ( spf_request->client_ver == AF_INET6 ) {
 				rr_ptr = SPF_dns_rlookup6(resolver,
 								spf_request->ipv6, ns_t_ptr, TRUE);
+				SPF_response_add_ttl(spf_response, rr_ptr);
 
 				if ( spf_server->debug ) {
 					INET_NTOP( AF_INET6, &spf_request->ipv6.s6_addr,
@@ -985,8 +1037,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 				}
 				if( rr_ptr->herrno == TRY_AGAIN ) {
 					SPF_dns_rr_free(rr_ptr);
-					SPF_FREE_LOOKUP_DATA();
-					return DONE_TEMPERR( SPF_E_DNS_ERROR );
+					SPF_I_TEMPERR( SPF_E_DNS_ERROR );
 				}
 
 
@@ -1002,6 +1053,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 
 					rr_aaaa = SPF_dns_lookup(resolver,
 							rr_ptr->rr[i]->ptr, ns_t_aaaa, TRUE);
+					SPF_response_add_ttl(spf_response, rr_aaaa);
 
 					if ( spf_server->debug )
 						SPF_debugf("%d:  found %d AAAA records for %s  (herrno: %d)",
@@ -1009,8 +1061,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 					if( rr_aaaa->herrno == TRY_AGAIN ) {
 						SPF_dns_rr_free(rr_ptr);
 						SPF_dns_rr_free(rr_aaaa);
-						SPF_FREE_LOOKUP_DATA();
-						return DONE_TEMPERR( SPF_E_DNS_ERROR );
+						SPF_I_TEMPERR( SPF_E_DNS_ERROR );
 					}
 
 					for( j = 0; j < rr_aaaa->num_rr; j++ ) {
@@ -1029,8 +1080,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 											rr_ptr->rr[i]->ptr, lookup)) {
 								SPF_dns_rr_free( rr_ptr );
 								SPF_dns_rr_free(rr_aaaa);
-								SPF_FREE_LOOKUP_DATA();
-								return DONE_MECH( mech->prefix_type );
+								SPF_I_MECH( mech->prefix_type );
 							}
 						}
 					}
@@ -1039,8 +1089,7 @@ SPF_record_interpret(SPF_record_t *spf_record,
 				SPF_dns_rr_free(rr_ptr);
 
 				if (max_exceeded) {
-					SPF_FREE_LOOKUP_DATA();
-					return DONE(SPF_RESULT_PERMERROR, SPF_REASON_NONE, SPF_E_BIG_DNS);
+					SPF_I_RESULT(SPF_RESULT_PERMERROR, SPF_REASON_NONE, SPF_E_BIG_DNS);
 				}
 			}
 
@@ -1051,25 +1100,19 @@ SPF_record_interpret(SPF_record_t *spf_record,
 		case MECH_REDIRECT:
 			SPF_ADD_DNS_MECH();
 
-			err = SPF_record_expand_data(spf_server,
+			err = SPF_i_expand_target(spf_server,
 					spf_request, spf_response,
-					SPF_mech_data(mech), SPF_mech_data_len(mech),
-					&buf, &buf_len );
-			if ( err == SPF_E_NO_MEMORY ) {
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_TEMPERR( err );
-			}
-			if ( err ) {
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_PERMERR( err );
-			}
-			lookup = buf;
-
-			/* XXX Maintain a stack depth here. Limit at 10. */
-			if (strcmp(lookup, spf_request->cur_dom) == 0) {
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_PERMERR( SPF_E_RECURSIVE );
-			}
+					var_mask, data, data_end,
+					&frame->buf, &frame->buf_len, &lookup );
+			if ( err == SPF_E_NO_MEMORY )
+				SPF_I_TEMPERR( err );
+			if ( err )
+				SPF_I_PERMERR( err );
+
+			if (strcmp(lookup, spf_request->cur_dom) == 0)
+				SPF_I_PERMERR( SPF_E_RECURSIVE );
+			if (depth + sp >= SPF_MAX_INCLUDE_DEPTH)
+				SPF_I_PERMERR( SPF_E_RECURSIVE );
 
 			/*
 			 * get the (compiled) SPF record
@@ -1090,141 +1133,65 @@ SPF_record_interpret(SPF_record_t *spf_record,
 				spf_request->cur_dom = save_cur_dom;
 				if (spf_record_subr)
 					SPF_record_free(spf_record_subr);
-				SPF_FREE_LOOKUP_DATA();
 				if (err == SPF_E_DNS_ERROR)
-					return DONE_TEMPERR( err );
+					SPF_I_TEMPERR( err );
 				else
-					return DONE_PERMERR( err );
+					SPF_I_PERMERR( err );
 			}
 
 			SPF_ASSERT_NOTNULL(spf_record_subr);
 
 			/*
-			 * If we are a redirect which is not within the scope
-			 * of any include.
+			 * find out whether this configuration passes
 			 */
+			frame = &frames[++sp];
 			if (mech->mech_type == MECH_REDIRECT) {
-				save_spf_response = NULL;
-				if (spf_response->spf_record_exp == spf_record)
+				/*
+				 * If we are a redirect which is not within the scope
+				 * of any include.
+				 */
+				if (includes == 0
+						&& spf_response->spf_record_exp == spf_record)
 					spf_response->spf_record_exp = spf_record_subr;
-				SPF_ASSERT_NOTNULL(spf_response->spf_record_exp);
+				SPF_i_frame_init(frame, SPF_I_FRAME_REDIRECT,
+							spf_record_subr, save_cur_dom,
+							spf_request, spf_server);
 			}
 			else {
-				save_spf_response = spf_response;
-				spf_response = SPF_response_new(spf_request);
-				if (! spf_response) {
-					if (spf_record_subr)
-						SPF_record_free(spf_record_subr);
-					SPF_FREE_LOOKUP_DATA();
-					return DONE_TEMPERR(SPF_E_NO_MEMORY);
-				}
-				spf_response->spf_record_exp = spf_record;
-				SPF_ASSERT_NOTNULL(spf_response->spf_record_exp);
+				includes++;
+				SPF_i_frame_init(frame, SPF_I_FRAME_INCLUDE,
+							spf_record_subr, save_cur_dom,
+							spf_request, spf_server);
 			}
-			/*
-			 * find out whether this configuration passes
-			 */
-			err = SPF_record_interpret(spf_record_subr,
-							spf_request, spf_response, depth + 1);
-			spf_request->cur_dom = save_cur_dom;
-			/* Now, if we were a redirect, the child called done()
-			 * and used spf_record_exp. In that case, we need not
-			 * worry that spf_record_subr is invalid after the free.
-			 * If we were not a redirect, then spf_record_subr
-			 * is still the record it was in the first place.
-			 * Thus we do not need to reset it now. */
-			SPF_record_free(spf_record_subr);
-			spf_record_subr = NULL;
-
-			if ( spf_server->debug > 0 )
-				SPF_debugf( "include/redirect:  executed SPF record:  %s  result: %s  reason: %s",
-						SPF_strerror( err ),
-						SPF_strresult( spf_response->result ),
-						SPF_strreason( spf_response->reason ) );
-			if (mech->mech_type == MECH_REDIRECT) {
-				SPF_FREE_LOOKUP_DATA();
-				return err;	/* One way or the other */
-			}
-			else { // if (spf_response->result != SPF_RESULT_INVALID) {
-				/* Set everything up properly again. */
-				spf_response_subr = spf_response;
-				spf_response = save_spf_response;
-				save_spf_response = NULL;
-
-				/* Rewrite according to prefix of include */
-				switch (SPF_response_result(spf_response_subr)) {
-					case SPF_RESULT_PASS:
-						/* Pass */
-						SPF_FREE_LOOKUP_DATA();
-						SPF_response_free(spf_response_subr);
-						return DONE_MECH( mech->prefix_type );
-
-					case SPF_RESULT_FAIL:
-					case SPF_RESULT_SOFTFAIL:
-					case SPF_RESULT_NEUTRAL:
-						/* No match */
-						SPF_response_free(spf_response_subr);
-						break;
-
-					case SPF_RESULT_TEMPERROR:
-						/* Generate TempError */
-						err = SPF_response_errcode(spf_response_subr);
-						SPF_FREE_LOOKUP_DATA();
-						SPF_response_free(spf_response_subr);
-						return DONE_TEMPERR( err );
-
-					case SPF_RESULT_NONE:
-						/* Generate PermError */
-						SPF_FREE_LOOKUP_DATA();
-						SPF_response_free(spf_response_subr);
-						return DONE_PERMERR(SPF_E_INCLUDE_RETURNED_NONE);
-					case SPF_RESULT_PERMERROR:
-					case SPF_RESULT_INVALID:
-						/* Generate PermError */
-						err = SPF_response_errcode(spf_response_subr);
-						SPF_FREE_LOOKUP_DATA();
-						SPF_response_free(spf_response_subr);
-						return DONE_PERMERR( err );
-
-				}
-#if 0
-				SPF_FREE_LOOKUP_DATA();
-				return err;	/* The sub-interpret called done() */
-#endif
-			}
-
-			break;
+			continue;
 
 		case MECH_IP4:
 			memcpy(&addr4, SPF_mech_ip4_data(mech), sizeof(addr4));
 			if ( SPF_i_match_ip4( spf_server, spf_request, mech, addr4 ) ) {
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_MECH( mech->prefix_type );
+				SPF_I_MECH( mech->prefix_type );
 			}
 			break;
 
 		case MECH_IP6:
 			memcpy(&addr6, SPF_mech_ip6_data(mech), sizeof(addr6));
 			if ( SPF_i_match_ip6( spf_server, spf_request, mech, addr6 ) ) {
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_MECH( mech->prefix_type );
+				SPF_I_MECH( mech->prefix_type );
 			}
 			break;
 
 		case MECH_EXISTS:
 			SPF_ADD_DNS_MECH();
 
-			err = SPF_record_expand_data(spf_server,
+			err = SPF_i_expand_target(spf_server,
 							spf_request, spf_response,
-							SPF_mech_data(mech),SPF_mech_data_len(mech),
-							&buf, &buf_len);
+							var_mask, data, data_end,
+							&frame->buf, &frame->buf_len, &lookup);
 			if (err != SPF_E_SUCCESS) {
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_TEMPERR( err );
+				SPF_I_TEMPERR( err );
 			}
-			lookup = buf;
 
-			rr_a = SPF_dns_lookup(resolver, lookup, ns_t_a, FALSE );
+			rr_a = SPF_dns_lookup(resolver, lookup, ns_t_a, should_cache);
+			SPF_response_add_ttl(spf_response, rr_a);
 
 			if ( spf_server->debug )
 				SPF_debugf( "found %d A records for %s  (herrno: %d)",
@@ -1232,55 +1199,105 @@ SPF_record_interpret(SPF_record_t *spf_record,
 
 			if( rr_a->herrno == TRY_AGAIN ) {
 				SPF_dns_rr_free(rr_a);
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_TEMPERR(SPF_E_DNS_ERROR);
+				SPF_I_TEMPERR(SPF_E_DNS_ERROR);
 			}
 			if ( rr_a->num_rr > 0 ) {
 				SPF_dns_rr_free(rr_a);
-				SPF_FREE_LOOKUP_DATA();
-				return DONE_MECH(mech->prefix_type);
+				SPF_I_MECH(mech->prefix_type);
 			}
 
 			SPF_dns_rr_free(rr_a);
 			break;
 
 		case MECH_ALL:
-			SPF_FREE_LOOKUP_DATA();
 			if (mech->prefix_type == PREFIX_UNKNOWN)
-				return DONE_PERMERR(SPF_E_UNKNOWN_MECH);
-			return DONE_MECH(mech->prefix_type);
+				SPF_I_PERMERR(SPF_E_UNKNOWN_MECH);
+			SPF_I_MECH(mech->prefix_type);
 			break;
 
 		default:
-			SPF_FREE_LOOKUP_DATA();
-			return DONE_PERMERR(SPF_E_UNKNOWN_MECH);
+			SPF_I_PERMERR(SPF_E_UNKNOWN_MECH);
 			break;
 		}
 
+
+next_mech:
+		frame->m = m + 1;
+		frame->mech = SPF_mech_next( mech );
+
 		/*
 		 * execute the local policy
 		 */
 
-		if ( mech == local_policy ) {
-			err = SPF_record_interpret(spf_server->local_policy,
-							spf_request, spf_response, depth + 1);
+		if ( m == frame->local_policy ) {
+			if (depth + sp >= SPF_MAX_INCLUDE_DEPTH)
+				SPF_I_PERMERR( SPF_E_RECURSIVE );
+			frame = &frames[++sp];
+			SPF_i_frame_init(frame, SPF_I_FRAME_POLICY,
+						spf_server->local_policy, spf_request->cur_dom,
+						spf_request, spf_server);
+		}
+		continue;
 
-			if ( spf_server->debug > 0 )
-				SPF_debugf( "local_policy:  executed SPF record:  %s  result: %s  reason: %s",
-							SPF_strerror( err ),
-							SPF_strresult( spf_response->result ),
-							SPF_strreason( spf_response->reason ) );
-
-			if (spf_response->result != SPF_RESULT_INVALID) {
-				SPF_FREE_LOOKUP_DATA();
-				return err;
-			}
+outcome:
+		if (includes == 0) {
+			/* Not within the scope of any include: this is it. */
+			err = DONE(result, reason, err);
+			break;
 		}
 
-		mech = SPF_mech_next( mech );
+		/* Everything above the innermost include passes its result on. */
+		while (frame->kind != SPF_I_FRAME_INCLUDE)
+			frame = SPF_i_frame_pop(frames, &sp, spf_request);
+		frame = SPF_i_frame_pop(frames, &sp, spf_request);
+		includes--;
+		spf_record = frame->spf_record;
+		mech = frame->mech;
+		m = frame->m;
+
+		if ( spf_server->debug > 0 )
+			SPF_debugf( "include:  executed SPF record:  %s  result: %s  reason: %s",
+					SPF_strerror( err ),
+					SPF_strresult( result ),
+					SPF_strreason( reason ) );
+
+		/* Rewrite according to prefix of include */
+		switch (result) {
+			case SPF_RESULT_PASS:
+				/* Pass */
+				SPF_I_MECH( mech->prefix_type );
+
+			case SPF_RESULT_FAIL:
+			case SPF_RESULT_SOFTFAIL:
+			case SPF_RESULT_NEUTRAL:
+				/* No match */
+				goto next_mech;
+
+			case SPF_RESULT_TEMPERROR:
+				/* Generate TempError */
+				SPF_I_TEMPERR( err );
+
+			case SPF_RESULT_NONE:
+				/* Generate PermError */
+				SPF_I_PERMERR( SPF_E_INCLUDE_RETURNED_NONE );
+
+			case SPF_RESULT_PERMERROR:
+			case SPF_RESULT_INVALID:
+			default:
+				/* Generate PermError */
+				SPF_I_PERMERR( err );
+		}
 	}
 
-	SPF_FREE_LOOKUP_DATA();
-	/* falling off the end is the same as ?all */
-	return DONE( SPF_RESULT_NEUTRAL, SPF_REASON_DEFAULT, SPF_E_SUCCESS );
+	while (sp > 0)
+		frame = SPF_i_frame_pop(frames, &sp, spf_request);
+	if (frame->buf != NULL)
+		free(frame->buf);
+
+#undef SPF_I_RESULT
+#undef SPF_I_TEMPERR
+#undef SPF_I_PERMERR
+#undef SPF_I_MECH
+
+	return err;
 }
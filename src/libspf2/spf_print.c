@@ -58,9 +58,7 @@ SPF_record_print(SPF_record_t *spf_record)
 	    spf_record->version,
 	    (int)spf_record->num_mech, (unsigned int)spf_record->mech_len, 
 	    (int)spf_record->num_mod, (unsigned int)spf_record->mod_len,
-	    (unsigned int)(sizeof(SPF_record_t)
-				+ spf_record->mech_len
-				+ spf_record->mod_len));
+	    (unsigned int)spf_record->rec_len);
 
     err = SPF_record_stringify(spf_record, &prt_buf, &prt_len);
     if ( err == SPF_E_RESULT_UNKNOWN )
@@ -44,6 +44,11 @@
 #define SPF_MSGSIZE		4096
 
 
+/**
+ * Creates an empty record.  The spf_server and text arguments are
+ * unused, and remain only for compatibility: records are not tied to
+ * a server.
+ */
 SPF_record_t *
 SPF_record_new(SPF_server_t *spf_server, const char *text)
 {
@@ -54,7 +59,52 @@ SPF_record_new(SPF_server_t *spf_server, const char *text)
 		return rp;
 	memset(rp, 0, sizeof(SPF_record_t));
 
-	rp->spf_server = spf_server;
+	rp->local_policy_idx = -1;
+	/* An empty record: all data is at the end. */
+	rp->rec_len = sizeof(SPF_record_t);
+	rp->mech_off = rp->mod_off = rp->rec_len;
+	rp->mech_vars_off = rp->mod_vars_off = rp->rec_len;
+	SPF_record_index_mods(rp);
+
+	return rp;
+}
+
+/**
+ * Allocates a record with room for the given amount of data, laid
+ * out as described in spf_record.h, and zeroed throughout so that
+ * equal records are equal bytes.
+ */
+SPF_record_t *
+SPF_record_alloc(int num_mech, size_t mech_len,
+				int num_mod, size_t mod_len)
+{
+	SPF_record_t	*rp;
+	size_t			 rec_len;
+	int				 i;
+
+	rec_len = _align_sz(sizeof(SPF_record_t))
+				+ _align_sz(mech_len) + _align_sz(mod_len)
+				+ (num_mech + num_mod) * sizeof(unsigned short);
+	rp = (SPF_record_t *)malloc(rec_len);
+	if (!rp)
+		return rp;
+	memset(rp, 0, rec_len);
+
+	rp->version = 1;
+	rp->num_mech = num_mech;
+	rp->num_mod = num_mod;
+	rp->local_policy_idx = -1;
+	for (i = 0; i < SPF_MOD_KNOWN_MAX; i++)
+		rp->mod_known_off[i] = -1;
+
+	rp->rec_len = rec_len;
+	rp->mech_off = _align_sz(sizeof(SPF_record_t));
+	rp->mech_len = mech_len;
+	rp->mod_off = rp->mech_off + _align_sz(mech_len);
+	rp->mod_len = mod_len;
+	rp->mech_vars_off = rp->mod_off + _align_sz(mod_len);
+	rp->mod_vars_off = rp->mech_vars_off
+				+ num_mech * sizeof(unsigned short);
 
 	return rp;
 }
@@ -62,10 +112,6 @@ SPF_record_new(SPF_server_t *spf_server, const char *text)
 void
 SPF_record_free(SPF_record_t *rp)
 {
-	if (rp->mech_first)
-		free(rp->mech_first);
-	if (rp->mod_first)
-		free(rp->mod_first);
 	free(rp);
 }
 
@@ -75,6 +121,43 @@ SPF_macro_free(SPF_macro_t *mac)
 	free(mac);
 }
 
+/** The names of the SPF_mod_known_t modifiers. */
+static const char *SPF_mod_known_names[SPF_MOD_KNOWN_MAX] = {
+	"exp",
+	SPF_EXP_MOD_NAME,
+};
+
+/**
+ * Finds the first instance of each known modifier, which is the one
+ * a lookup by name would find.  Called once the modifiers are in
+ * place.
+ */
+void
+SPF_record_index_mods(SPF_record_t *spf_record)
+{
+	SPF_mod_t	*mod;
+	size_t		 name_len;
+	int			 i;
+	int			 k;
+
+	for (k = 0; k < SPF_MOD_KNOWN_MAX; k++)
+		spf_record->mod_known_off[k] = -1;
+
+	mod = SPF_record_mod_first(spf_record);
+	for (i = 0; i < spf_record->num_mod; i++) {
+		for (k = 0; k < SPF_MOD_KNOWN_MAX; k++) {
+			name_len = strlen(SPF_mod_known_names[k]);
+			if (spf_record->mod_known_off[k] == -1
+					&& mod->name_len == name_len
+					&& strncasecmp(SPF_mod_name(mod),
+							SPF_mod_known_names[k], name_len) == 0)
+				spf_record->mod_known_off[k] =
+					(char *)mod - (char *)SPF_record_mod_first(spf_record);
+		}
+		mod = SPF_mod_next(mod);
+	}
+}
+
 /* This expects datap and datalenp NOT to be initialised. */
 static SPF_errcode_t
 SPF_record_find_mod_data(
@@ -100,7 +183,7 @@ SPF_record_find_mod_data(
 	 * find modifier
 	 */
 
-	mod = spf_record->mod_first;
+	mod = SPF_record_mod_first(spf_record);
 	for( i = 0; i < spf_record->num_mod; i++ ) {
 		if ( name_len == mod->name_len
 			 && strncasecmp( SPF_mod_name( mod ), mod_name, name_len ) == 0 )
@@ -150,3 +233,88 @@ SPF_record_find_mod_value(SPF_server_t *spf_server,
 	return SPF_record_expand_data(spf_server, spf_request, spf_response,
 					data, data_len, bufp, buflenp);
 }
+
+/**
+ * As SPF_record_find_mod_value(), for a modifier which the compiler
+ * has indexed, without searching the modifiers by name.
+ */
+SPF_errcode_t
+SPF_record_get_mod_value(SPF_server_t *spf_server,
+		SPF_request_t *spf_request,
+		SPF_response_t *spf_response,
+		SPF_record_t *spf_record,
+		SPF_mod_known_t mod_known,
+		char **bufp, size_t *buflenp)
+{
+	SPF_mod_t		*mod;
+
+	SPF_ASSERT_NOTNULL(spf_record);
+	SPF_ASSERT_NOTNULL(bufp);
+	SPF_ASSERT_NOTNULL(buflenp);
+
+	if (mod_known < 0 || mod_known >= SPF_MOD_KNOWN_MAX)
+		return SPF_E_INVALID_OPT;
+	if (spf_record->mod_known_off[mod_known] < 0)
+		return SPF_E_MOD_NOT_FOUND;
+
+	mod = (SPF_mod_t *)((char *)SPF_record_mod_first(spf_record)
+					+ spf_record->mod_known_off[mod_known]);
+	return SPF_record_expand_data(spf_server, spf_request, spf_response,
+					SPF_mod_data(mod), mod->data_len, bufp, buflenp);
+}
+
+/**
+ * Returns the set of macro variables referred to by a block of
+ * compiled data, as a mask of SPF_VAR_BIT(PARM_x) bits.
+ */
+unsigned int
+SPF_data_var_mask(SPF_data_t *data, size_t data_len)
+{
+	SPF_data_t		*d, *data_end;
+	unsigned int	 mask;
+
+	SPF_ASSERT_NOTNULL(data);
+
+	mask = 0;
+	data_end = (SPF_data_t *)((char *)data + data_len);
+	for (d = data; d < data_end; d = SPF_data_next(d)) {
+		if (d->dc.parm_type == PARM_CIDR)
+			continue;
+		if (d->ds.parm_type == PARM_STRING)
+			continue;
+		mask |= SPF_VAR_BIT(d->dv.parm_type);
+	}
+
+	return mask;
+}
+
+unsigned int
+SPF_record_mech_vars(SPF_record_t *spf_record, int idx)
+{
+	SPF_ASSERT_NOTNULL(spf_record);
+	if (idx < 0 || idx >= spf_record->num_mech)
+		return 0;
+	return SPF_record_mech_vars_first(spf_record)[idx];
+}
+
+unsigned int
+SPF_record_mod_vars(SPF_record_t *spf_record, int idx)
+{
+	SPF_ASSERT_NOTNULL(spf_record);
+	if (idx < 0 || idx >= spf_record->num_mod)
+		return 0;
+	return SPF_record_mod_vars_first(spf_record)[idx];
+}
+
+/**
+ * Whether the DNS answer for a mechanism's target is worth caching.
+ *
+ * A target which uses only literal text, %{d}, %{r} and %{v} names
+ * the same domain for every client, so the answer will be reused.
+ * Targets built from the sender or client address are not.
+ */
+int
+SPF_record_mech_should_cache(SPF_record_t *spf_record, int idx)
+{
+	return (SPF_record_mech_vars(spf_record, idx) & ~SPF_VAR_STATIC) == 0;
+}
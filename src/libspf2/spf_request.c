@@ -28,6 +28,17 @@
 # endif
 #endif
 
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
 
 #include "spf.h"
 #include "spf_dns.h"
@@ -74,6 +85,9 @@ SPF_request_set_ipv4(SPF_request_t *sr, struct in_addr addr)
 		free(sr->client_dom);
 		sr->client_dom = NULL;
 	}
+	sr->client_ip[0] = '\0';
+	sr->client_ip_p[0] = '\0';
+	sr->time_str[0] = '\0';
 	sr->client_ver = AF_INET;
 	sr->ipv4 = addr;
 	return SPF_E_SUCCESS;
@@ -86,6 +100,9 @@ SPF_request_set_ipv6(SPF_request_t *sr, struct in6_addr addr)
 		free(sr->client_dom);
 		sr->client_dom = NULL;
 	}
+	sr->client_ip[0] = '\0';
+	sr->client_ip_p[0] = '\0';
+	sr->time_str[0] = '\0';
 	sr->client_ver = AF_INET6;
 	sr->ipv6 = addr;
 	return SPF_E_SUCCESS;
@@ -118,6 +135,7 @@ SPF_request_set_helo_dom(SPF_request_t *sr, const char *dom)
 {
 	SPF_ASSERT_NOTNULL(dom);
 	SPF_FREE(sr->helo_dom);
+	sr->time_str[0] = '\0';
 	sr->helo_dom = strdup(dom);
 	if (! sr->helo_dom)
 		return SPF_E_NO_MEMORY;
@@ -145,6 +163,7 @@ SPF_request_set_env_from(SPF_request_t *sr, const char *from)
 	SPF_FREE(sr->env_from);
 	SPF_FREE(sr->env_from_lp);
 	SPF_FREE(sr->env_from_dp);
+	sr->time_str[0] = '\0';
 
 	if (*from == '\0' && sr->helo_dom != NULL)
 		from = sr->helo_dom;
@@ -208,6 +227,76 @@ SPF_request_get_client_dom(SPF_request_t *sr)
 	return sr->client_dom;
 }
 
+const char *
+SPF_request_get_client_ip(SPF_request_t *sr)
+{
+	static const char	 hex_digits[] = "0123456789abcdef";
+	char				*p;
+	int					 i;
+
+	SPF_ASSERT_NOTNULL(sr);
+
+	if (sr->client_ip[0] != '\0')
+		return sr->client_ip;
+
+	if (sr->client_ver == AF_INET) {
+		if (inet_ntop(AF_INET, &sr->ipv4,
+						sr->client_ip, sizeof(sr->client_ip)) == NULL)
+			return NULL;
+	}
+	else if (sr->client_ver == AF_INET6) {
+		/* The dotted nibble form, most significant first. */
+		p = sr->client_ip;
+		for (i = 0; i < array_elem(sr->ipv6.s6_addr); i++) {
+			*p++ = hex_digits[sr->ipv6.s6_addr[i] >> 4];
+			*p++ = '.';
+			*p++ = hex_digits[sr->ipv6.s6_addr[i] & 0xf];
+			*p++ = '.';
+		}
+		/* squash the final '.' */
+		p[-1] = '\0';
+	}
+	else
+		return NULL;
+
+	return sr->client_ip;
+}
+
+const char *
+SPF_request_get_client_ip_p(SPF_request_t *sr)
+{
+	SPF_ASSERT_NOTNULL(sr);
+
+	if (sr->client_ip_p[0] != '\0')
+		return sr->client_ip_p;
+
+	if (sr->client_ver == AF_INET) {
+		if (inet_ntop(AF_INET, &sr->ipv4,
+						sr->client_ip_p, sizeof(sr->client_ip_p)) == NULL)
+			return NULL;
+	}
+	else if (sr->client_ver == AF_INET6) {
+		if (inet_ntop(AF_INET6, &sr->ipv6,
+						sr->client_ip_p, sizeof(sr->client_ip_p)) == NULL)
+			return NULL;
+	}
+	else
+		return NULL;
+
+	return sr->client_ip_p;
+}
+
+const char *
+SPF_request_get_time(SPF_request_t *sr)
+{
+	SPF_ASSERT_NOTNULL(sr);
+
+	if (sr->time_str[0] == '\0')
+		snprintf(sr->time_str, sizeof(sr->time_str), "%ld",
+						(long)time(NULL));
+	return sr->time_str;
+}
+
 int
 SPF_request_is_loopback(SPF_request_t *sr)
 {
@@ -289,10 +378,21 @@ SPF_request_query_mailfrom(SPF_request_t *spf_request,
 
 	SPF_request_prepare(spf_request);
 
+	if (spf_server->result_cache != NULL
+			&& SPF_result_cache_find(spf_server->result_cache,
+						spf_request, *spf_responsep, &err))
+		return err;
+
 	err = SPF_server_get_record(spf_server, spf_request,
 					*spf_responsep, &spf_record);
-	return SPF_request_query_record(spf_request, *spf_responsep,
+	err = SPF_request_query_record(spf_request, *spf_responsep,
 					spf_record, err);
+
+	if (spf_server->result_cache != NULL)
+		SPF_result_cache_add(spf_server->result_cache,
+						spf_request, *spf_responsep, err);
+
+	return err;
 }
 
 /* This interface isn't finalised. */
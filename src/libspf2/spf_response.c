@@ -29,9 +29,26 @@
 #endif
 
 
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#ifdef HAVE_NETDB_H
+# include <netdb.h>
+#endif
+
+
 #include "spf.h"
 #include "spf_dns.h"
 #include "spf_response.h"
+#include "spf_internal.h"
 
 SPF_response_t *
 SPF_response_new(SPF_request_t *spf_request)
@@ -179,6 +196,48 @@ SPF_response_get_explanation(SPF_response_t *rp)
 	return rp->explanation;
 }
 
+/**
+ * Notes a DNS answer consulted while building this response, so that
+ * the result cache knows how long the answer stays valid. Answers
+ * which carry no TTL do not constrain it; a temporary failure, a TTL
+ * of 0, or a cached answer which has already expired, makes the
+ * response uncacheable.
+ */
+void
+SPF_response_add_ttl(SPF_response_t *rp, SPF_dns_rr_t *rr)
+{
+	if (rp->ttl < 0)
+		return;
+	if (rr->herrno == TRY_AGAIN) {
+		rp->ttl = -1;
+		return;
+	}
+
+	/* A cached answer has already used up some of its life. */
+	if (rr->utc_ttl != 0)
+		SPF_response_limit_ttl(rp, rr->utc_ttl - time(NULL));
+	else if (rr->ttl != SPF_DNS_TTL_NONE)
+		SPF_response_limit_ttl(rp, rr->ttl);
+}
+
+/**
+ * As SPF_response_add_ttl(), for an answer which was taken from a
+ * cache with ttl seconds left to live. An answer which has already
+ * expired makes the response uncacheable.
+ */
+void
+SPF_response_limit_ttl(SPF_response_t *rp, time_t ttl)
+{
+	if (rp->ttl < 0)
+		return;
+	if (ttl <= 0) {
+		rp->ttl = -1;
+		return;
+	}
+	if (rp->ttl == 0 || ttl < rp->ttl)
+		rp->ttl = ttl;
+}
+
 /* Error manipulation functions */
 
 #define SPF_ERRMSGSIZE		4096
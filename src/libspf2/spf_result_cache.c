@@ -0,0 +1,525 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either:
+ *
+ *   a) The GNU Lesser General Public License as published by the Free
+ *      Software Foundation; either version 2.1, or (at your option) any
+ *      later version,
+ *
+ *   OR
+ *
+ *   b) The two-clause BSD license.
+ *
+ * These licenses can be found with the distribution in the file LICENSES
+ */
+
+#include "spf_sys_config.h"
+
+#ifdef STDC_HEADERS
+# include <stdio.h>        /* stdin / stdout */
+# include <stdlib.h>       /* malloc / free */
+# include <ctype.h>        /* isupper / tolower */
+#endif
+
+#ifdef HAVE_STRING_H
+# include <string.h>       /* strstr / strdup */
+#else
+# ifdef HAVE_STRINGS_H
+#  include <strings.h>       /* strstr / strdup */
+# endif
+#endif
+
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "spf.h"
+#include "spf_dns.h"
+#include "spf_internal.h"
+
+
+/**
+ * @file
+ *
+ * A cache of complete SPF results, sitting in front of
+ * SPF_record_interpret().
+ *
+ * An evaluation is a pure function of the domain, the client address,
+ * the server configuration, the DNS, and whichever macro variables the
+ * records along the way chose to expand. So an entry records the
+ * domain and client address as its key, together with the values of
+ * the request variables it actually expanded (%{l}, %{s}, %{o} and
+ * %{h}). Another request for the same domain and address which agrees
+ * on those variables must walk exactly the same path, and so may have
+ * the same answer. The other variables are either derived from the key
+ * (%{d}, %{i}, %{c}, %{v}) or from the server (%{r}). An answer which
+ * used %{t} or %{p} is never cached: %{p} comes from PTR and A lookups
+ * of its own, whose TTLs and failures the response does not see.
+ *
+ * Entries expire at the shortest TTL of the DNS answers consulted,
+ * capped at max_ttl.
+ *
+ * Only the verdict, explanation and messages are stored. The header
+ * comment and Received-SPF header mention the envelope sender and
+ * HELO name, which are not part of the key, so they are regenerated
+ * for each hit.
+ */
+
+
+/** The request variables which an entry must match on. */
+static const int SPF_result_cache_vars[] = {
+	PARM_LP_FROM, PARM_ENV_FROM, PARM_DP_FROM, PARM_HELO_DOM
+};
+
+#define SPF_RESULT_CACHE_NVARS	array_elem(SPF_result_cache_vars)
+
+/** The longest a hash chain may grow before its oldest entries go. */
+#define SPF_RESULT_CACHE_CHAIN	8
+
+typedef
+struct _SPF_result_cache_bucket_t {
+	struct _SPF_result_cache_bucket_t	*next;
+	unsigned int	 hash;
+	time_t			 utc_ttl;
+
+	/* The key. */
+	char			*domain;
+	int				 client_ver;
+	struct in_addr	 ipv4;
+	struct in6_addr	 ipv6;
+	int				 use_local_policy;
+	unsigned int	 var_mask;
+	char			*vars[SPF_RESULT_CACHE_NVARS];
+
+	/* The answer. */
+	SPF_result_t	 result;
+	SPF_reason_t	 reason;
+	SPF_errcode_t	 err;
+	SPF_errcode_t	 query_err;		/**< What the query returned. */
+	char			*explanation;
+	SPF_error_t		*errors;
+	unsigned short	 errors_length;
+	int				 num_dns_mech;
+} SPF_result_cache_bucket_t;
+
+struct SPF_result_cache_struct {
+	SPF_result_cache_bucket_t	**cache;
+	int							  cache_size;
+	pthread_mutex_t				  cache_lock;
+	time_t						  max_ttl;
+	unsigned long				  hits;
+	unsigned long				  misses;
+};
+
+
+static const char *
+SPF_result_cache_var(SPF_request_t *spf_request, int parm_type)
+{
+	switch (parm_type) {
+		case PARM_LP_FROM:
+			return spf_request->env_from_lp;
+		case PARM_ENV_FROM:
+			return spf_request->env_from;
+		case PARM_DP_FROM:
+			return spf_request->env_from_dp;
+		case PARM_HELO_DOM:
+			return spf_request->helo_dom;
+		default:
+			return NULL;
+	}
+}
+
+/* Domains are compared case-insensitively, so hash them that way. */
+static unsigned int
+SPF_result_cache_hash(SPF_request_t *spf_request)
+{
+	const unsigned char	*p;
+	unsigned int		 h;
+	size_t				 i;
+
+	h = 5381;
+	for (p = (const unsigned char *)spf_request->cur_dom; *p; p++)
+		h = h * 33 + tolower(*p);
+	if (spf_request->client_ver == AF_INET) {
+		p = (const unsigned char *)&spf_request->ipv4;
+		for (i = 0; i < sizeof(spf_request->ipv4); i++)
+			h = h * 33 + p[i];
+	}
+	else {
+		p = (const unsigned char *)&spf_request->ipv6;
+		for (i = 0; i < sizeof(spf_request->ipv6); i++)
+			h = h * 33 + p[i];
+	}
+	return h;
+}
+
+static int
+SPF_result_cache_match(SPF_result_cache_bucket_t *bucket,
+				SPF_request_t *spf_request, unsigned int hash)
+{
+	const char	*var;
+	int			 i;
+
+	if (bucket->hash != hash)
+		return FALSE;
+	if (bucket->client_ver != spf_request->client_ver)
+		return FALSE;
+	if (bucket->use_local_policy != spf_request->use_local_policy)
+		return FALSE;
+	if (bucket->client_ver == AF_INET) {
+		if (bucket->ipv4.s_addr != spf_request->ipv4.s_addr)
+			return FALSE;
+	}
+	else {
+		if (memcmp(&bucket->ipv6, &spf_request->ipv6,
+						sizeof(bucket->ipv6)) != 0)
+			return FALSE;
+	}
+	if (strcasecmp(bucket->domain, spf_request->cur_dom) != 0)
+		return FALSE;
+
+	for (i = 0; i < SPF_RESULT_CACHE_NVARS; i++) {
+		if (!(bucket->var_mask & (1U << SPF_result_cache_vars[i])))
+			continue;
+		var = SPF_result_cache_var(spf_request, SPF_result_cache_vars[i]);
+		if (var == NULL || bucket->vars[i] == NULL) {
+			if (var != bucket->vars[i])
+				return FALSE;
+		}
+		else if (strcmp(var, bucket->vars[i]) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+SPF_result_cache_bucket_free(SPF_result_cache_bucket_t *bucket)
+{
+	int		 i;
+
+	if (bucket->domain)
+		free(bucket->domain);
+	for (i = 0; i < SPF_RESULT_CACHE_NVARS; i++)
+		if (bucket->vars[i])
+			free(bucket->vars[i]);
+	if (bucket->explanation)
+		free(bucket->explanation);
+	if (bucket->errors) {
+		for (i = 0; i < bucket->errors_length; i++)
+			if (bucket->errors[i].message)
+				free(bucket->errors[i].message);
+		free(bucket->errors);
+	}
+	free(bucket);
+}
+
+/* This must be called with the lock held. */
+static void
+SPF_result_cache_clear(SPF_result_cache_t *cache)
+{
+	SPF_result_cache_bucket_t	*bucket;
+	SPF_result_cache_bucket_t	*prev;
+	int							 i;
+
+	for (i = 0; i < cache->cache_size; i++) {
+		bucket = cache->cache[i];
+		while (bucket != NULL) {
+			prev = bucket;
+			bucket = bucket->next;
+			SPF_result_cache_bucket_free(prev);
+		}
+		cache->cache[i] = NULL;
+	}
+}
+
+SPF_result_cache_t *
+SPF_result_cache_new(int cache_bits, time_t max_ttl)
+{
+	SPF_result_cache_t	*cache;
+
+	cache = (SPF_result_cache_t *)malloc(sizeof(SPF_result_cache_t));
+	if (cache == NULL)
+		return NULL;
+	memset(cache, 0, sizeof(SPF_result_cache_t));
+
+	cache->cache_size = 1 << cache_bits;
+	cache->max_ttl = max_ttl;
+	cache->cache = calloc(cache->cache_size, sizeof(*cache->cache));
+	if (cache->cache == NULL) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&(cache->cache_lock), NULL);
+
+	return cache;
+}
+
+void
+SPF_result_cache_free(SPF_result_cache_t *cache)
+{
+	SPF_ASSERT_NOTNULL(cache);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+	SPF_result_cache_clear(cache);
+	free(cache->cache);
+	cache->cache = NULL;
+	pthread_mutex_unlock(&(cache->cache_lock));
+
+	pthread_mutex_destroy(&(cache->cache_lock));
+	free(cache);
+}
+
+void
+SPF_result_cache_flush(SPF_result_cache_t *cache)
+{
+	SPF_ASSERT_NOTNULL(cache);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+	SPF_result_cache_clear(cache);
+	pthread_mutex_unlock(&(cache->cache_lock));
+}
+
+void
+SPF_result_cache_stats(SPF_result_cache_t *cache, unsigned long *hitsp,
+				unsigned long *missesp)
+{
+	SPF_ASSERT_NOTNULL(cache);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+	*hitsp = cache->hits;
+	*missesp = cache->misses;
+	pthread_mutex_unlock(&(cache->cache_lock));
+}
+
+/**
+ * Fills in the verdict of spf_response from the cache, and finishes
+ * it with SPF_i_done(). Returns TRUE on a hit, and sets *errp to what
+ * the original query returned.
+ *
+ * spf_request->cur_dom must already be set.
+ */
+int
+SPF_result_cache_find(SPF_result_cache_t *cache,
+				SPF_request_t *spf_request,
+				SPF_response_t *spf_response,
+				SPF_errcode_t *errp)
+{
+	SPF_result_cache_bucket_t	*bucket;
+	SPF_result_cache_bucket_t	*prev;
+	SPF_result_t				 result;
+	SPF_reason_t				 reason;
+	SPF_errcode_t				 err;
+	unsigned int				 hash;
+	time_t						 now;
+	int							 idx;
+	int							 i;
+
+	SPF_ASSERT_NOTNULL(cache);
+	SPF_ASSERT_NOTNULL(spf_request);
+	SPF_ASSERT_NOTNULL(spf_response);
+
+	if (spf_request->cur_dom == NULL)
+		return FALSE;
+	if (spf_request->client_ver != AF_INET
+			&& spf_request->client_ver != AF_INET6)
+		return FALSE;
+
+	hash = SPF_result_cache_hash(spf_request);
+	idx = hash & (cache->cache_size - 1);
+	time(&now);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+
+	prev = NULL;
+	bucket = cache->cache[idx];
+	while (bucket != NULL) {
+		if (bucket->utc_ttl < now) {
+			if (prev != NULL)
+				prev->next = bucket->next;
+			else
+				cache->cache[idx] = bucket->next;
+			SPF_result_cache_bucket_free(bucket);
+			bucket = (prev != NULL) ? prev->next : cache->cache[idx];
+			continue;
+		}
+		if (SPF_result_cache_match(bucket, spf_request, hash))
+			break;
+		prev = bucket;
+		bucket = bucket->next;
+	}
+
+	if (bucket == NULL) {
+		cache->misses++;
+		pthread_mutex_unlock(&(cache->cache_lock));
+		return FALSE;
+	}
+	cache->hits++;
+
+	/* Copy out everything we need while we hold the lock. */
+	result = bucket->result;
+	reason = bucket->reason;
+	err = bucket->err;
+	*errp = bucket->query_err;
+	spf_response->num_dns_mech = bucket->num_dns_mech;
+	if (bucket->explanation) {
+		spf_response->explanation = strdup(bucket->explanation);
+		if (spf_response->explanation == NULL) {
+			pthread_mutex_unlock(&(cache->cache_lock));
+			return FALSE;
+		}
+	}
+	for (i = 0; i < bucket->errors_length; i++) {
+		if (bucket->errors[i].is_error)
+			SPF_response_add_error(spf_response, bucket->errors[i].code,
+							"%s", bucket->errors[i].message);
+		else
+			SPF_response_add_warn(spf_response, bucket->errors[i].code,
+							"%s", bucket->errors[i].message);
+	}
+
+	pthread_mutex_unlock(&(cache->cache_lock));
+
+	SPF_i_done(spf_response, result, reason, err);
+	return TRUE;
+}
+
+/**
+ * Stores a completed response, if it is fit to be stored.
+ */
+SPF_errcode_t
+SPF_result_cache_add(SPF_result_cache_t *cache,
+				SPF_request_t *spf_request,
+				SPF_response_t *spf_response,
+				SPF_errcode_t query_err)
+{
+	SPF_result_cache_bucket_t	*bucket;
+	SPF_result_cache_bucket_t	*prev;
+	SPF_result_cache_bucket_t	*next;
+	const char					*var;
+	time_t						 ttl;
+	time_t						 now;
+	int							 idx;
+	int							 i;
+
+	SPF_ASSERT_NOTNULL(cache);
+	SPF_ASSERT_NOTNULL(spf_request);
+	SPF_ASSERT_NOTNULL(spf_response);
+
+	if (spf_request->cur_dom == NULL)
+		return SPF_E_SUCCESS;
+	if (spf_request->client_ver != AF_INET
+			&& spf_request->client_ver != AF_INET6)
+		return SPF_E_SUCCESS;
+	switch (spf_response->result) {
+		case SPF_RESULT_INVALID:
+		case SPF_RESULT_TEMPERROR:
+			return SPF_E_SUCCESS;
+		default:
+			break;
+	}
+	if (spf_response->reason == SPF_REASON_LOCALHOST)
+		return SPF_E_SUCCESS;
+	if (spf_response->var_mask
+				& (SPF_VAR_BIT(PARM_TIME) | SPF_VAR_BIT(PARM_CLIENT_DOM)))
+		return SPF_E_SUCCESS;
+
+	ttl = spf_response->ttl;
+	if (ttl < 0)
+		return SPF_E_SUCCESS;
+	if (ttl == 0 || ttl > cache->max_ttl)
+		ttl = cache->max_ttl;
+	if (ttl <= 0)
+		return SPF_E_SUCCESS;
+
+	bucket = (SPF_result_cache_bucket_t *)
+				malloc(sizeof(SPF_result_cache_bucket_t));
+	if (bucket == NULL)
+		return SPF_E_NO_MEMORY;
+	memset(bucket, 0, sizeof(SPF_result_cache_bucket_t));
+
+	bucket->hash = SPF_result_cache_hash(spf_request);
+	time(&now);
+	bucket->utc_ttl = now + ttl;
+	bucket->domain = strdup(spf_request->cur_dom);
+	if (bucket->domain == NULL)
+		goto fail;
+	bucket->client_ver = spf_request->client_ver;
+	bucket->ipv4 = spf_request->ipv4;
+	bucket->ipv6 = spf_request->ipv6;
+	bucket->use_local_policy = spf_request->use_local_policy;
+	bucket->var_mask = spf_response->var_mask;
+	for (i = 0; i < SPF_RESULT_CACHE_NVARS; i++) {
+		if (!(bucket->var_mask & (1U << SPF_result_cache_vars[i])))
+			continue;
+		var = SPF_result_cache_var(spf_request, SPF_result_cache_vars[i]);
+		if (var == NULL)
+			continue;
+		bucket->vars[i] = strdup(var);
+		if (bucket->vars[i] == NULL)
+			goto fail;
+	}
+
+	bucket->result = spf_response->result;
+	bucket->reason = spf_response->reason;
+	bucket->err = spf_response->err;
+	bucket->query_err = query_err;
+	bucket->num_dns_mech = spf_response->num_dns_mech;
+	if (spf_response->explanation) {
+		bucket->explanation = strdup(spf_response->explanation);
+		if (bucket->explanation == NULL)
+			goto fail;
+	}
+	if (spf_response->errors_length > 0) {
+		bucket->errors = calloc(spf_response->errors_length,
+						sizeof(SPF_error_t));
+		if (bucket->errors == NULL)
+			goto fail;
+		bucket->errors_length = spf_response->errors_length;
+		for (i = 0; i < spf_response->errors_length; i++) {
+			bucket->errors[i] = spf_response->errors[i];
+			bucket->errors[i].message =
+					strdup(spf_response->errors[i].message
+						? spf_response->errors[i].message : "");
+			if (bucket->errors[i].message == NULL)
+				goto fail;
+		}
+	}
+
+	idx = bucket->hash & (cache->cache_size - 1);
+
+	pthread_mutex_lock(&(cache->cache_lock));
+	bucket->next = cache->cache[idx];
+	cache->cache[idx] = bucket;
+	/* Senders with macro-laden records can otherwise fill a chain
+	 * with one entry per local-part. Newest entries are at the top. */
+	for (i = 1, prev = bucket; prev->next != NULL; i++) {
+		if (i >= SPF_RESULT_CACHE_CHAIN
+				|| prev->next->utc_ttl < now) {
+			next = prev->next;
+			prev->next = next->next;
+			SPF_result_cache_bucket_free(next);
+		}
+		else
+			prev = prev->next;
+	}
+	pthread_mutex_unlock(&(cache->cache_lock));
+
+	return SPF_E_SUCCESS;
+
+fail:
+	SPF_result_cache_bucket_free(bucket);
+	return SPF_E_NO_MEMORY;
+}
@@ -0,0 +1,493 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either:
+ *
+ *   a) The GNU Lesser General Public License as published by the Free
+ *      Software Foundation; either version 2.1, or (at your option) any
+ *      later version,
+ *
+ *   OR
+ *
+ *   b) The two-clause BSD license.
+ *
+ * These licenses can be found with the distribution in the file LICENSES
+ */
+
+#include "spf_sys_config.h"
+
+#ifdef STDC_HEADERS
+# include <stdio.h>        /* stdin / stdout */
+# include <stdlib.h>       /* malloc / free */
+# include <ctype.h>        /* isalpha / isalnum */
+#endif
+
+#ifdef HAVE_STRING_H
+# include <string.h>       /* strstr / strdup */
+#else
+# ifdef HAVE_STRINGS_H
+#  include <strings.h>       /* strstr / strdup */
+# endif
+#endif
+
+#include "spf.h"
+#include "spf_internal.h"
+#include "spf_record.h"
+
+
+/**
+ * @file
+ *
+ * A portable form of compiled SPF records, so that a record may be
+ * stored or sent to another process and loaded without parsing the
+ * text again.
+ *
+ * The serialized record is a fixed header followed by the mechanisms
+ * and modifiers, laid out exactly as in spf_record.h, except that:
+ *
+ *   * all multi-byte integers are big-endian
+ *
+ *   * the flags of a macro variable are a big-endian 16 bit word
+ *     (SPF_SER_VAR_*), rather than a compiler-dependent bitfield
+ *
+ *   * the unused bytes and all padding are zero
+ *
+ * IP addresses are already in network order, and are copied as they
+ * stand.  The macro dependency masks are not stored, since they are
+ * recomputed from the data on loading.
+ *
+ * The header is:
+ *
+ *   0	"SPFc"
+ *   4	format version (SPF_SER_VERSION)
+ *   5	SPF version
+ *   6	number of mechanisms
+ *   7	number of modifiers
+ *   8	number of DNS mechanisms
+ *   9	local policy index + 1, or 0 if none; this must be the index
+ *	the compiler would have chosen for these mechanisms
+ *  10	reserved, zero (2 bytes)
+ *  12	length of the mechanisms (4 bytes)
+ *  16	length of the modifiers (4 bytes)
+ *
+ * A record which is loaded is checked against the rules the compiler
+ * applies to what it produces: the mechanism and modifier types and
+ * lengths, the targets of the mechanisms which need one, the
+ * characters of modifier names, and which macro variables may appear
+ * where. The data may come from elsewhere, and the interpreter trusts
+ * the lengths it finds. The text of a domain-spec is not parsed again.
+ */
+
+
+#define SPF_SER_MAGIC		"SPFc"
+#define SPF_SER_VERSION		1
+#define SPF_SER_HDR_LEN		20
+
+#define SPF_SER_VAR_REV		0x0001
+#define SPF_SER_VAR_URL		0x0002
+#define SPF_SER_VAR_DOT		0x0004
+#define SPF_SER_VAR_DASH	0x0008
+#define SPF_SER_VAR_PLUS	0x0010
+#define SPF_SER_VAR_EQUAL	0x0020
+#define SPF_SER_VAR_BAR		0x0040
+#define SPF_SER_VAR_UNDER	0x0080
+#define SPF_SER_VAR_ALL		0x00ff
+
+
+static inline void
+SPF_ser_put16(unsigned char *p, unsigned int v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+}
+
+static inline void
+SPF_ser_put32(unsigned char *p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static inline unsigned int
+SPF_ser_get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline unsigned long
+SPF_ser_get32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+			| ((unsigned long)p[2] << 8) | (unsigned long)p[3];
+}
+
+
+/**
+ * Writes the data items in [data, data + data_len) to dst, which is
+ * zeroed and at least data_len bytes long.
+ */
+static void
+SPF_ser_put_data(unsigned char *dst, SPF_data_t *data, size_t data_len)
+{
+	SPF_data_t		*d;
+	SPF_data_t		*data_end;
+	unsigned char	*p;
+	unsigned int	 flags;
+
+	data_end = (SPF_data_t *)((char *)data + data_len);
+	for (d = data; d < data_end; d = SPF_data_next(d)) {
+		p = dst + ((char *)d - (char *)data);
+		p[0] = d->ds.parm_type;
+		switch (d->ds.parm_type) {
+			case PARM_STRING:
+				p[1] = d->ds.len;
+				memcpy(p + sizeof(SPF_data_t), SPF_data_str(d), d->ds.len);
+				break;
+			case PARM_CIDR:
+				p[1] = d->dc.ipv4;
+				p[2] = d->dc.ipv6;
+				break;
+			default:
+				flags = 0;
+				if (d->dv.rev)			flags |= SPF_SER_VAR_REV;
+				if (d->dv.url_encode)	flags |= SPF_SER_VAR_URL;
+				if (d->dv.delim_dot)	flags |= SPF_SER_VAR_DOT;
+				if (d->dv.delim_dash)	flags |= SPF_SER_VAR_DASH;
+				if (d->dv.delim_plus)	flags |= SPF_SER_VAR_PLUS;
+				if (d->dv.delim_equal)	flags |= SPF_SER_VAR_EQUAL;
+				if (d->dv.delim_bar)	flags |= SPF_SER_VAR_BAR;
+				if (d->dv.delim_under)	flags |= SPF_SER_VAR_UNDER;
+				p[1] = d->dv.num_rhs;
+				SPF_ser_put16(p + 2, flags);
+				break;
+		}
+	}
+}
+
+/**
+ * Checks a modifier name as the compiler reads one: a letter, then
+ * letters, digits, '_' and '-'. "redirect" is compiled as a
+ * mechanism, and so is not a modifier name either.
+ */
+static int
+SPF_ser_check_name(const unsigned char *name, size_t name_len)
+{
+	size_t		 i;
+
+	if (!isalpha(name[0]))
+		return -1;
+	for (i = 1; i < name_len; i++)
+		if (!isalnum(name[i]) && name[i] != '_' && name[i] != '-')
+			return -1;
+	if (name_len == sizeof("redirect") - 1
+			&& strncasecmp((const char *)name, "redirect", name_len) == 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Reads and checks the data items in [src, src + data_len) into
+ * data, which is zeroed and at least data_len bytes long.
+ *
+ * @param cidr_ok Whether a CIDR item may appear: it must then be first.
+ * @param is_mod Whether the data is a modifier's, which alone may use
+ * %{c}, %{r} and %{t}.
+ */
+static SPF_errcode_t
+SPF_ser_get_data(SPF_data_t *data, const unsigned char *src,
+				size_t data_len, int cidr_ok, int is_mod)
+{
+	SPF_data_t			*d;
+	const unsigned char	*p;
+	size_t				 off;
+	size_t				 item_len;
+	unsigned int		 flags;
+
+	for (off = 0; off < data_len; off = _align_sz(off + item_len)) {
+		if (data_len - off < sizeof(SPF_data_t))
+			return SPF_E_INVALID_RECORD;
+		p = src + off;
+		d = (SPF_data_t *)((char *)data + off);
+		item_len = sizeof(SPF_data_t);
+		switch (p[0]) {
+			case PARM_STRING:
+				item_len += p[1] + 1;
+				if (p[2] || p[3] || item_len > data_len - off)
+					return SPF_E_INVALID_RECORD;
+				if (memchr(p + sizeof(SPF_data_t), '\0', p[1] + 1)
+						!= p + sizeof(SPF_data_t) + p[1])
+					return SPF_E_INVALID_RECORD;
+				d->ds.parm_type = PARM_STRING;
+				d->ds.len = p[1];
+				memcpy(SPF_data_str(d), p + sizeof(SPF_data_t), p[1]);
+				break;
+			case PARM_CIDR:
+				if (!cidr_ok || off != 0 || p[1] > 32 || p[2] > 128 || p[3])
+					return SPF_E_INVALID_RECORD;
+				d->dc.parm_type = PARM_CIDR;
+				d->dc.ipv4 = p[1];
+				d->dc.ipv6 = p[2];
+				break;
+			default:
+				if (p[0] > PARM_REC_DOM || p[1] > 128)
+					return SPF_E_INVALID_RECORD;
+				if (!is_mod && (p[0] == PARM_CLIENT_IP_P
+						|| p[0] == PARM_TIME || p[0] == PARM_REC_DOM))
+					return SPF_E_INVALID_RECORD;
+				flags = SPF_ser_get16(p + 2);
+				if (flags & ~SPF_SER_VAR_ALL)
+					return SPF_E_INVALID_RECORD;
+				d->dv.parm_type = p[0];
+				d->dv.num_rhs = p[1];
+				d->dv.rev = (flags & SPF_SER_VAR_REV) != 0;
+				d->dv.url_encode = (flags & SPF_SER_VAR_URL) != 0;
+				d->dv.delim_dot = (flags & SPF_SER_VAR_DOT) != 0;
+				d->dv.delim_dash = (flags & SPF_SER_VAR_DASH) != 0;
+				d->dv.delim_plus = (flags & SPF_SER_VAR_PLUS) != 0;
+				d->dv.delim_equal = (flags & SPF_SER_VAR_EQUAL) != 0;
+				d->dv.delim_bar = (flags & SPF_SER_VAR_BAR) != 0;
+				d->dv.delim_under = (flags & SPF_SER_VAR_UNDER) != 0;
+				break;
+		}
+	}
+
+	return SPF_E_SUCCESS;
+}
+
+
+/**
+ * Serializes a compiled record.
+ *
+ * @param spf_record The record to serialize.
+ * @param datap Set to a malloc()ed buffer, which the caller must free.
+ * @param lenp Set to the length of *datap.
+ */
+SPF_errcode_t
+SPF_record_serialize(SPF_record_t *spf_record, void **datap, size_t *lenp)
+{
+	unsigned char	*buf;
+	unsigned char	*p;
+	size_t			 len;
+	SPF_mech_t		*mech;
+	SPF_mod_t		*mod;
+	int				 i;
+
+	SPF_ASSERT_NOTNULL(spf_record);
+	SPF_ASSERT_NOTNULL(datap);
+	SPF_ASSERT_NOTNULL(lenp);
+
+	len = SPF_SER_HDR_LEN + spf_record->mech_len + spf_record->mod_len;
+	buf = (unsigned char *)malloc(len);
+	if (buf == NULL)
+		return SPF_E_NO_MEMORY;
+	memset(buf, 0, len);
+
+	memcpy(buf, SPF_SER_MAGIC, 4);
+	buf[4] = SPF_SER_VERSION;
+	buf[5] = spf_record->version;
+	buf[6] = spf_record->num_mech;
+	buf[7] = spf_record->num_mod;
+	buf[8] = spf_record->num_dns_mech;
+	buf[9] = spf_record->local_policy_idx + 1;
+	SPF_ser_put32(buf + 12, spf_record->mech_len);
+	SPF_ser_put32(buf + 16, spf_record->mod_len);
+
+	mech = SPF_record_mech_first(spf_record);
+	for (i = 0; i < spf_record->num_mech; i++) {
+		p = buf + SPF_SER_HDR_LEN
+				+ ((char *)mech - (char *)SPF_record_mech_first(spf_record));
+		p[0] = mech->prefix_type;
+		p[1] = mech->mech_type;
+		SPF_ser_put16(p + 2, mech->mech_len);
+		if (mech->mech_type == MECH_IP4 || mech->mech_type == MECH_IP6)
+			memcpy(p + sizeof(SPF_mech_t), SPF_mech_data(mech),
+							SPF_mech_data_len(mech));
+		else
+			SPF_ser_put_data(p + sizeof(SPF_mech_t), SPF_mech_data(mech),
+							SPF_mech_data_len(mech));
+		mech = SPF_mech_next(mech);
+	}
+
+	mod = SPF_record_mod_first(spf_record);
+	for (i = 0; i < spf_record->num_mod; i++) {
+		p = buf + SPF_SER_HDR_LEN + spf_record->mech_len
+				+ ((char *)mod - (char *)SPF_record_mod_first(spf_record));
+		SPF_ser_put16(p, mod->name_len);
+		SPF_ser_put16(p + 2, mod->data_len);
+		memcpy(p + sizeof(SPF_mod_t), SPF_mod_name(mod), mod->name_len);
+		SPF_ser_put_data(p + ((char *)SPF_mod_data(mod) - (char *)mod),
+						SPF_mod_data(mod), mod->data_len);
+		mod = SPF_mod_next(mod);
+	}
+
+	*datap = buf;
+	*lenp = len;
+	return SPF_E_SUCCESS;
+}
+
+/**
+ * Loads a record written by SPF_record_serialize().
+ *
+ * Returns SPF_E_INVALID_RECORD if the data is not a serialized
+ * record of a version which this library understands, or is in any
+ * way inconsistent.
+ */
+SPF_errcode_t
+SPF_record_deserialize(SPF_record_t **spf_recordp,
+				const void *data, size_t len)
+{
+	const unsigned char	*buf = (const unsigned char *)data;
+	const unsigned char	*src;
+	SPF_record_t		*spf_record;
+	SPF_mech_t			*mech;
+	SPF_mod_t			*mod;
+	unsigned short		*vars;
+	size_t				 mech_len;
+	size_t				 mod_len;
+	size_t				 off;
+	size_t				 data_len;
+	size_t				 name_off;
+	int					 num_dns_mech;
+	int					 i;
+	SPF_errcode_t		 err;
+
+	SPF_ASSERT_NOTNULL(spf_recordp);
+	SPF_ASSERT_NOTNULL(data);
+
+	*spf_recordp = NULL;
+
+	if (len < SPF_SER_HDR_LEN)
+		return SPF_E_INVALID_RECORD;
+	if (memcmp(buf, SPF_SER_MAGIC, 4) != 0)
+		return SPF_E_INVALID_RECORD;
+	if (buf[4] != SPF_SER_VERSION || buf[5] != 1)
+		return SPF_E_INVALID_RECORD;
+	if (buf[8] > buf[6] || buf[10] || buf[11])
+		return SPF_E_INVALID_RECORD;
+	mech_len = SPF_ser_get32(buf + 12);
+	mod_len = SPF_ser_get32(buf + 16);
+	if (mech_len > len || mod_len > len
+			|| SPF_SER_HDR_LEN + mech_len + mod_len != len)
+		return SPF_E_INVALID_RECORD;
+	if (mech_len % _ALIGN_SZ || mod_len % _ALIGN_SZ)
+		return SPF_E_INVALID_RECORD;
+
+	spf_record = SPF_record_alloc(buf[6], mech_len, buf[7], mod_len);
+	if (spf_record == NULL)
+		return SPF_E_NO_MEMORY;
+	spf_record->local_policy_idx = (int)buf[9] - 1;
+
+	err = SPF_E_INVALID_RECORD;
+
+	src = buf + SPF_SER_HDR_LEN;
+	vars = SPF_record_mech_vars_first(spf_record);
+	num_dns_mech = 0;
+	off = 0;
+	for (i = 0; i < spf_record->num_mech; i++) {
+		if (mech_len - off < sizeof(SPF_mech_t))
+			goto fail;
+		mech = (SPF_mech_t *)((char *)SPF_record_mech_first(spf_record) + off);
+		mech->prefix_type = src[off];
+		mech->mech_type = src[off + 1];
+		mech->mech_len = SPF_ser_get16(src + off + 2);
+		switch (mech->prefix_type) {
+			case PREFIX_PASS:
+			case PREFIX_FAIL:
+			case PREFIX_SOFTFAIL:
+			case PREFIX_NEUTRAL:
+				break;
+			default:
+				goto fail;
+		}
+		switch (mech->mech_type) {
+			case MECH_IP4:
+				if (mech->mech_len > 32)
+					goto fail;
+				break;
+			case MECH_IP6:
+				if (mech->mech_len > 128)
+					goto fail;
+				break;
+			case MECH_INCLUDE:
+			case MECH_EXISTS:
+			case MECH_REDIRECT:
+				/* These need a target domain. */
+				if (mech->mech_len == 0)
+					goto fail;
+				/* FALLTHROUGH */
+			case MECH_A:
+			case MECH_MX:
+			case MECH_PTR:
+				if (mech->mech_len > SPF_MAX_MECH_LEN)
+					goto fail;
+				num_dns_mech++;
+				break;
+			case MECH_ALL:
+				if (mech->mech_len != 0)
+					goto fail;
+				break;
+			default:
+				goto fail;
+		}
+		data_len = SPF_mech_data_len(mech);
+		if (mech_len - off - sizeof(SPF_mech_t) < data_len)
+			goto fail;
+		if (mech->mech_type == MECH_IP4 || mech->mech_type == MECH_IP6) {
+			memcpy(SPF_mech_data(mech),
+					src + off + sizeof(SPF_mech_t), data_len);
+		}
+		else {
+			if (SPF_ser_get_data(SPF_mech_data(mech),
+					src + off + sizeof(SPF_mech_t), data_len,
+					mech->mech_type == MECH_A
+					|| mech->mech_type == MECH_MX, FALSE) != SPF_E_SUCCESS)
+				goto fail;
+			vars[i] = SPF_data_var_mask(SPF_mech_data(mech), data_len);
+		}
+		off = _align_sz(off + sizeof(SPF_mech_t) + data_len);
+	}
+	if (off != mech_len || num_dns_mech != buf[8])
+		goto fail;
+	spf_record->num_dns_mech = num_dns_mech;
+	if (spf_record->local_policy_idx
+			!= SPF_record_local_policy_idx(spf_record))
+		goto fail;
+
+	src = buf + SPF_SER_HDR_LEN + mech_len;
+	vars = SPF_record_mod_vars_first(spf_record);
+	off = 0;
+	for (i = 0; i < spf_record->num_mod; i++) {
+		if (mod_len - off < sizeof(SPF_mod_t))
+			goto fail;
+		mod = (SPF_mod_t *)((char *)SPF_record_mod_first(spf_record) + off);
+		mod->name_len = SPF_ser_get16(src + off);
+		mod->data_len = SPF_ser_get16(src + off + 2);
+		if (mod->name_len == 0 || mod->name_len > SPF_MAX_MOD_LEN
+				|| mod->data_len > SPF_MAX_MOD_LEN)
+			goto fail;
+		name_off = (char *)SPF_mod_data(mod) - (char *)mod;
+		if (mod_len - off < name_off + mod->data_len)
+			goto fail;
+		if (SPF_ser_check_name(src + off + sizeof(SPF_mod_t),
+				mod->name_len) < 0)
+			goto fail;
+		memcpy(SPF_mod_name(mod), src + off + sizeof(SPF_mod_t),
+				mod->name_len);
+		if (SPF_ser_get_data(SPF_mod_data(mod), src + off + name_off,
+				mod->data_len, FALSE, TRUE) != SPF_E_SUCCESS)
+			goto fail;
+		vars[i] = SPF_data_var_mask(SPF_mod_data(mod), mod->data_len);
+		off = _align_sz(off + name_off + mod->data_len);
+	}
+	if (off != mod_len)
+		goto fail;
+	SPF_record_index_mods(spf_record);
+
+	*spf_recordp = spf_record;
+	return SPF_E_SUCCESS;
+
+fail:
+	SPF_record_free(spf_record);
+	return err;
+}
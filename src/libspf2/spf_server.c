@@ -116,6 +116,10 @@ SPF_server_new_common_post(SPF_server_t *sp)
 		SPF_response_free(spf_response);
 	}
 
+	/* Not having the cache is no reason to fail. */
+	sp->exp_cache = SPF_exp_cache_new(SPF_EXP_CACHE_BITS,
+					SPF_EXP_CACHE_MAX_TTL);
+
 	spf_response = NULL;
 	err = SPF_server_set_localpolicy(sp, "", 0, &spf_response);
 	if (err != SPF_E_SUCCESS)
@@ -207,13 +211,92 @@ SPF_server_free(SPF_server_t *sp)
 		SPF_macro_free(sp->explanation);
 	if (sp->rec_dom)
 		free(sp->rec_dom);
+	if (sp->result_cache)
+		SPF_result_cache_free(sp->result_cache);
+	if (sp->exp_cache)
+		SPF_exp_cache_free(sp->exp_cache);
 	/* XXX TODO: Free other parts of the structure. */
 	free(sp);
 }
 
+/**
+ * Cached results were computed under the old configuration.
+ */
+static void
+SPF_server_flush_result_cache(SPF_server_t *sp)
+{
+	if (sp->result_cache)
+		SPF_result_cache_flush(sp->result_cache);
+}
+
+SPF_errcode_t
+SPF_server_set_result_cache(SPF_server_t *sp, int cache_bits,
+				time_t max_ttl)
+{
+	SPF_result_cache_t	*cache;
+
+	if (cache_bits < 0 || cache_bits > 16)
+		return SPF_E_INVALID_OPT;
+
+	cache = NULL;
+	if (cache_bits > 0) {
+		cache = SPF_result_cache_new(cache_bits, max_ttl);
+		if (cache == NULL)
+			return SPF_E_NO_MEMORY;
+	}
+
+	if (sp->result_cache)
+		SPF_result_cache_free(sp->result_cache);
+	sp->result_cache = cache;
+
+	return SPF_E_SUCCESS;
+}
+
+SPF_errcode_t
+SPF_server_set_exp_cache(SPF_server_t *sp, int cache_bits,
+				time_t max_ttl)
+{
+	SPF_exp_cache_t	*cache;
+
+	if (cache_bits < 0 || cache_bits > 16)
+		return SPF_E_INVALID_OPT;
+
+	cache = NULL;
+	if (cache_bits > 0) {
+		cache = SPF_exp_cache_new(cache_bits, max_ttl);
+		if (cache == NULL)
+			return SPF_E_NO_MEMORY;
+	}
+
+	if (sp->exp_cache)
+		SPF_exp_cache_free(sp->exp_cache);
+	sp->exp_cache = cache;
+
+	return SPF_E_SUCCESS;
+}
+
+void
+SPF_server_get_stats(SPF_server_t *sp, SPF_server_stats_t *stats)
+{
+	SPF_ASSERT_NOTNULL(sp);
+	SPF_ASSERT_NOTNULL(stats);
+
+	memset(stats, 0, sizeof(SPF_server_stats_t));
+	if (sp->result_cache)
+		SPF_result_cache_stats(sp->result_cache,
+						&stats->result_hits, &stats->result_misses);
+	if (sp->exp_cache)
+		SPF_exp_cache_stats(sp->exp_cache,
+						&stats->exp_hits, &stats->exp_misses);
+}
+
 SPF_errcode_t
 SPF_server_set_rec_dom(SPF_server_t *sp, const char *dom)
 {
+	SPF_server_flush_result_cache(sp);
+	/* Cached explanations may have expanded %{r}. */
+	if (sp->exp_cache)
+		SPF_exp_cache_flush(sp->exp_cache);
 	if (sp->rec_dom)
 		free(sp->rec_dom);
 	if (dom == NULL)
@@ -231,6 +314,17 @@ SPF_server_set_sanitize(SPF_server_t *sp, int sanitize)
 	return SPF_E_SUCCESS;
 }
 
+SPF_errcode_t
+SPF_server_set_compile_mode(SPF_server_t *sp, SPF_compile_mode_t mode)
+{
+	if (mode != SPF_COMPILE_DIAGNOSTIC && mode != SPF_COMPILE_PRODUCTION)
+		return SPF_E_INVALID_OPT;
+	sp->compile_mode = mode;
+	/* Cached results carry the compiler's warnings. */
+	SPF_server_flush_result_cache(sp);
+	return SPF_E_SUCCESS;
+}
+
 SPF_errcode_t
 SPF_server_set_explanation(SPF_server_t *sp, const char *exp,
 				SPF_response_t **spf_responsep)
@@ -252,6 +346,7 @@ SPF_server_set_explanation(SPF_server_t *sp, const char *exp,
 		if (sp->explanation)
 			SPF_macro_free(sp->explanation);
 		sp->explanation = spf_macro;
+		SPF_server_flush_result_cache(sp);
 	}
 	else {
 		SPF_response_add_error(*spf_responsep, err,
@@ -299,6 +394,7 @@ SPF_server_set_localpolicy(SPF_server_t *sp, const char *policy,
 		if (sp->local_policy)
 			SPF_record_free(sp->local_policy);
 		sp->local_policy = spf_record;
+		SPF_server_flush_result_cache(sp);
 	}
 	else {
 		SPF_response_add_error(*spf_responsep, err,
@@ -349,6 +445,10 @@ SPF_server_get_record(SPF_server_t *spf_server,
 	rr_type = ns_t_spf;
 retry:
 	rr_txt = SPF_dns_lookup(resolver, domain, rr_type, TRUE);
+	/* A temporary failure here is either retried as TXT or reported
+	 * as a TEMPERROR, which is never cached anyway. */
+	if (rr_txt->herrno != TRY_AGAIN)
+		SPF_response_add_ttl(spf_response, rr_txt);
 
 	switch (rr_txt->herrno) {
 		case HOST_NOT_FOUND:
@@ -503,7 +603,8 @@ retry:
  */
 #define SPF_ACCESS_INT(f) \
 	SPF_errcode_t SPF_server_set_ ## f(SPF_server_t *s, int n) { \
-		s->f = n; return SPF_E_SUCCESS; \
+		s->f = n; SPF_server_flush_result_cache(s); \
+		return SPF_E_SUCCESS; \
 	} \
 	int SPF_server_get_ ## f(SPF_server_t *s) { \
 		return s->f; \
@@ -166,6 +166,10 @@ SPF_strerror( SPF_errcode_t spf_c_err )
 	return "Multiple SPF or TXT records for domain.";
 	break;
 
+	case SPF_E_INVALID_RECORD:
+	return "Invalid serialized SPF record";
+	break;
+
     default:
 	return "Unknown SPF error code";
 	break;
@@ -108,7 +108,17 @@
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <ctype.h>
+#include <limits.h>
 #include <sys/wait.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define SPFD_EPOLL
+#ifdef MSG_WAITFORONE
+#define SPFD_MMSG	/* recvmmsg() and sendmmsg() */
+#endif
+#endif
 
 #include <pthread.h>
 
@@ -130,11 +140,61 @@
 #define FREE_RESPONSE(x) FREE((x), SPF_response_free)
 #define FREE_STRING(x) FREE((x), free)
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SPFD_WORKERS		16		/* Default size of the worker pool */
+#define SPFD_QUEUE			1024	/* Default depth of the work queue */
+#define SPFD_MAX_REQUEST	4096	/* Longest request we will buffer */
+#define SPFD_UDP_BURST		64		/* Datagrams read per wakeup */
+#define SPFD_MAX_EVENTS		64
+#define SPFD_MAX_LISTENERS	64
+#define SPFD_PIPELINE		32		/* Default requests per connection */
+#define SPFD_FLIGHT_BUCKETS	1024	/* Hash chains for coalescing */
+#define SPFD_MEMO_CHAIN		8		/* Memoized results kept per chain */
+#define SPFD_PERIP_BUCKETS	1024	/* Hash chains for per-client counts */
+#define SPFD_MAX_OUTPUT		65536	/* Unsent replies before we stop reading */
+#define SPFD_HIST_MAX		16		/* Most buckets in a histogram */
+#define SPFD_RESULT_CACHE_TTL	3600	/* Default result_cache_ttl */
+
+/*
+ * The binary protocol. Every integer is in network byte order, and
+ * every frame starts with a u32 giving the length of the rest.
+ *
+ * Request: u8 version, u8 field mask, u32 id, u8 address family (4
+ * or 6), the 4 or 16 byte address, then helo, sender and rcpt, each a
+ * u16 length and that many bytes. An empty sender is the null sender.
+ *
+ * Response: u8 version, u8 field mask, u32 id, u8 result, u8 reason,
+ * u16 error, then each string field in the mask, in bit order, as a
+ * u16 length and that many bytes. The result, reason and error are
+ * the values of libspf2's SPF_result_t, SPF_reason_t and
+ * SPF_errcode_t. The mask in a response says which of the requested
+ * fields were available; if it has SPFD_BIN_BUSY set, the request was
+ * not evaluated because the server is overloaded, and the result is
+ * SPF_RESULT_TEMPERROR.
+ *
+ * A connection may have many requests in flight; each response goes
+ * out as soon as it is ready, carrying the id of its request.
+ */
+#define SPFD_BIN_VERSION		1
+#define SPFD_BIN_SMTP_COMMENT	0x01
+#define SPFD_BIN_HEADER_COMMENT	0x02
+#define SPFD_BIN_RECEIVED_SPF	0x04
+#define SPFD_BIN_BUSY			0x80	/* Response only: turned away */
+
 typedef
 struct _config_t {
 	int		 tcpport;
 	int		 udpport;
 	char	*path;
+	int		 policyport;
+	char	*policypath;
+	int		 binport;
+	char	*binpath;
+	int		 statsport;
+	char	*statspath;
 #ifdef HAVE_PWD_H
 	uid_t	 pathuser;
 #endif
@@ -153,17 +213,122 @@ struct _config_t {
 	bool	 sec_mx;
 	char	*fallback;
 
+	char	*config;		/* Server settings, read again on SIGHUP */
+	bool	 onerequest;
+
+	int		 workers;
+	int		 queue;
+	int		 listeners;
+	int		 pipeline;
+	int		 memo;			/* Seconds to remember a result for */
+	int		 inflight;		/* Most requests admitted at once */
+	int		 perip;			/* Most admitted per client address */
+} config_t;
+
+/*
+ * The settings which go into an SPF_server_t. They come from the
+ * -config file, one "name value" per line.
+ */
+typedef
+struct _server_config_t {
 	char	*rec_dom;
 	bool	 sanitize;
 	int		 max_lookup;
 	char	*localpolicy;
 	bool	 use_trusted;
 	char	*explanation;
-	bool	 onerequest;
-} config_t;
+	int		 result_cache;		/* log2 of the hash chains; 0 is off */
+	int		 result_cache_ttl;
+	int		 exp_cache;
+	int		 exp_cache_ttl;
+} server_config_t;
+
+/*
+ * An SPF_server_t made from one reading of the settings. An evaluation
+ * holds a reference to it, so that a reload can put a new one in its
+ * place while evaluations already running finish on the old one.
+ */
+typedef
+struct _server_t {
+	int				 refcount;	/* Under spfd_state.server_lock */
+	SPF_server_t	*spf_server;
+	SPF_server_stats_t	 counted;	/* Already in stats.retired */
+} server_t;
+
+typedef struct _loop_t loop_t;
+typedef struct _conn_t conn_t;
+
+typedef
+enum {
+	EV_UDP,
+	EV_TCP,
+	EV_UNIX,
+	EV_WAKE,
+	EV_CONN,
+} ev_type_t;
+
+/* What a stream listener, and so its connections, speak. */
+typedef
+enum {
+	PROTO_TEXT,
+	PROTO_POLICY,	/* Postfix SMTP access policy delegation */
+	PROTO_BINARY,
+	PROTO_STATS,	/* Not a request protocol: metrics on demand */
+} proto_t;
+
+#define EV_IN	0x1
+#define EV_OUT	0x2
+#define EV_ERR	0x4
+
+/* Anything the event loop watches starts with one of these. */
+typedef
+struct _ev_t {
+	ev_type_t	 type;
+	proto_t		 proto;		/* Stream listeners and connections */
+	int			 fd;
+	int			 events;
+	bool		 watched;
+} ev_t;
+
+/*
+ * What the formatters need from an evaluation. It does not change once
+ * made, and is shared by every request which asked the same question.
+ */
+typedef
+struct _result_t {
+	pthread_mutex_t	 lock;
+	int				 refcount;
+
+	bool			 have_response;
+	SPF_result_t	 result;
+	SPF_reason_t	 reason;
+	SPF_errcode_t	 err;	/* Of the response, or of the query */
+	char			*smtp_comment;
+	char			*header_comment;
+	char			*received_spf;
+} result_t;
+
+typedef struct _flight_t flight_t;
+typedef struct _perip_t perip_t;
+
+typedef
+enum {
+	FLIGHT_NONE,		/* Not asked: the request was bad */
+	FLIGHT_LEAD,		/* Evaluate it, then answer the followers */
+	FLIGHT_FOLLOW,		/* Wait for the leader to answer */
+	FLIGHT_MEMO,		/* Already answered */
+} flight_role_t;
 
 typedef
 struct _request_t {
+	struct _request_t	*next;
+	loop_t		*loop;
+	conn_t		*conn;		/* NULL for a datagram */
+	proto_t		 proto;
+	struct _request_t	*pipe_next;	/* In order of arrival on conn */
+	bool		 done;
+	bool		 sent;
+
 	int		 sock;
 	union {
 		struct sockaddr_in	in;
@@ -177,23 +342,188 @@ struct _request_t {
 	char		*helo;
 	char		*sender;
 	char		*rcpt_to;
+	char		*id;
+
+	/* Only for the binary protocol. */
+	int			 family;
+	union {
+		struct in_addr	in4;
+		struct in6_addr	in6;
+	} ipaddr;
+	unsigned int	 bin_id;
+	unsigned int	 bin_mask;
 
 	SPF_errcode_t	 spf_err;
-	SPF_request_t	*spf_request;
-	SPF_response_t	*spf_response;
+	result_t	*result;
+	flight_t	*flight;	/* Set while we evaluate for others */
+	flight_role_t	 role;
+	bool		 admitted;
+	perip_t		*perip;
+	struct timespec	 start;	/* When the loop read it */
 
 	char		 fmt[4096];
 	int			 fmtlen;
 } request_t;
 
+/*
+ * A stream connection. Up to spfd_config.pipeline requests from it may
+ * be in flight at once; replies to untagged requests go out in order.
+ */
+struct _conn_t {
+	ev_t		 ev;
+	loop_t		*loop;
+
+	char		*in;
+	size_t		 inlen;
+	char		*out;
+	size_t		 outlen;
+	size_t		 outoff;
+
+	request_t	*pipe_head;
+	request_t	*pipe_tail;
+	int			 busy;		/* Requests not yet answered */
+	bool		 eof;
+	bool		 closing;
+	bool		 dead;		/* Socket closed, waiting for busy == 0 */
+	conn_t		*reap_next;
+};
+
+struct _loop_t {
+#ifdef SPFD_EPOLL
+	int			 epfd;
+#else
+	ev_t		**watch;
+	int			 nwatch;
+	int			 swatch;
+#endif
+	ev_t		 udp;
+	ev_t		 tcp;
+	ev_t		 unx;
+	ev_t		 policy_tcp;
+	ev_t		 policy_unx;
+	ev_t		 bin_tcp;
+	ev_t		 bin_unx;
+	ev_t		 stats_tcp;
+	ev_t		 stats_unx;
+	ev_t		 wake;
+	int			 wake_w;
+
+	/* Datagram requests kept for reuse, buffers and all. */
+	request_t	*spare[SPFD_UDP_BURST];
+	int			 nspare;
+
+	/* Finished requests, handed back by the workers. */
+	pthread_mutex_t	 lock;
+	request_t	*done_head;
+	request_t	*done_tail;
+
+	/* Conns freed while a batch of events, which may name them, runs. */
+	conn_t		*reap;
+};
+
+typedef
+struct _pool_t {
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 not_empty;
+	pthread_cond_t	 not_full;
+	request_t	*head;
+	request_t	*tail;
+	int			 depth;
+} pool_t;
+
+/*
+ * An evaluation in flight, which identical requests wait on, or its
+ * result, kept for spfd_config.memo seconds.
+ */
+struct _flight_t {
+	struct _flight_t	*next;
+	unsigned int	 hash;
+	char			*key;
+	size_t			 keylen;
+	result_t		*result;	/* NULL while in flight */
+	int				 generation;	/* Of the server it started under */
+	time_t			 expires;
+	request_t		*waiters;
+};
+
+/* How many admitted requests are about one client address. */
+struct _perip_t {
+	struct _perip_t	*next;
+	unsigned int	 hash;
+	int				 count;
+	char			 addr[INET6_ADDRSTRLEN];
+};
+
+/* A Prometheus histogram; the buckets are made cumulative on output. */
+typedef
+struct _hist_t {
+	const double	*bounds;
+	int				 nbounds;
+	unsigned long	 bucket[SPFD_HIST_MAX + 1];	/* The last is +Inf */
+	unsigned long	 count;
+	double			 sum;
+} hist_t;
+
+/* DNS lookups made on one worker, counted by the layers around the cache. */
+typedef
+struct _dns_count_t {
+	unsigned long	 lookups;	/* Asked of the cache */
+	unsigned long	 queries;	/* Passed on by the cache */
+} dns_count_t;
+
+typedef
+struct _stats_t {
+	pthread_mutex_t	 lock;
+	unsigned long	 requests[PROTO_STATS];
+	unsigned long	 shed;
+	unsigned long	 results[SPF_RESULT_PERMERROR + 1];
+	unsigned long	 unknown;		/* Answered without a result */
+	unsigned long	 memo;
+	unsigned long	 coalesced;
+	unsigned long	 evaluations;
+	unsigned long	 dns_lookups;
+	unsigned long	 dns_queries;
+	hist_t			 request_seconds;
+	hist_t			 evaluation_seconds;
+	hist_t			 evaluation_lookups;
+	SPF_server_stats_t	 retired;	/* Of servers replaced by reloads */
+	unsigned long	 reloads;
+	unsigned long	 reload_failures;
+} stats_t;
+
 typedef
 struct _state_t {
-	int	sock_udp;
-	int	sock_tcp;
+	/* One of each inet socket per listener, unless they share. */
+	int	sock_udp[SPFD_MAX_LISTENERS];
+	int	sock_tcp[SPFD_MAX_LISTENERS];
 	int	sock_unix;
+	int	sock_policy_tcp;
+	int	sock_policy_unix;
+	int	sock_bin_tcp;
+	int	sock_bin_unix;
+	int	sock_stats_tcp;
+	int	sock_stats_unix;
+
+	pool_t	 pool;
+	loop_t	*loops;
+
+	pthread_mutex_t	 flight_lock;
+	flight_t		*flight[SPFD_FLIGHT_BUCKETS];
+	int				 generation;	/* Of the server; bumped by reloads */
+
+	/* The DNS layers outlive every server, cache and all. */
+	SPF_dns_server_t	*resolver;
+	pthread_mutex_t	 server_lock;
+	server_t		*server;
+
+	pthread_mutex_t	 admit_lock;
+	int				 admitted;
+	perip_t			*perip[SPFD_PERIP_BUCKETS];
+
+	stats_t			 stats;
+	pthread_key_t	 dns_key;	/* The worker's dns_count_t */
 } state_t;
 
-static SPF_server_t	*spf_server;
 static config_t		 spfd_config;
 static state_t		 spfd_state;
 
@@ -250,21 +580,85 @@ static const char *
 request_check(request_t *req)
 {
 	const char	*msg = NULL;
-	if (!req->ip)
+	if (!req->ip && !req->family)
 		msg = "No IP address given";
 	else if (!req->sender)
 		msg = "No sender address given";
 	else
 		return NULL;
-	snprintf(req->fmt, 4095,
+	req->fmtlen = snprintf(req->fmt, 4095,
 		"result=unknown\n"
 		"reason=%s\n",
 		msg);
 	return msg;
 }
 
+static char *
+strdup_or_null(const char *s)
+{
+	return s ? strdup(s) : NULL;
+}
+
+/* Summarizes an evaluation; err is used if there is no response. */
+static result_t *
+result_new(SPF_response_t *spf_response, SPF_errcode_t err)
+{
+	result_t	*res;
+
+	res = (result_t *)calloc(1, sizeof(result_t));
+	if (res == NULL)
+		return NULL;
+	pthread_mutex_init(&res->lock, NULL);
+	res->refcount = 1;
+
+	if (spf_response) {
+		res->have_response = TRUE;
+		res->result = SPF_response_result(spf_response);
+		res->reason = SPF_response_reason(spf_response);
+		res->err = SPF_response_errcode(spf_response);
+		res->smtp_comment = strdup_or_null(
+				SPF_response_get_smtp_comment(spf_response));
+		res->header_comment = strdup_or_null(
+				SPF_response_get_header_comment(spf_response));
+		res->received_spf = strdup_or_null(
+				SPF_response_get_received_spf(spf_response));
+	}
+	else {
+		res->err = err;
+	}
+	return res;
+}
+
+static result_t *
+result_ref(result_t *res)
+{
+	pthread_mutex_lock(&res->lock);
+	res->refcount++;
+	pthread_mutex_unlock(&res->lock);
+	return res;
+}
+
+static void
+result_unref(result_t *res)
+{
+	int		 refcount;
+
+	if (res == NULL)
+		return;
+	pthread_mutex_lock(&res->lock);
+	refcount = --res->refcount;
+	pthread_mutex_unlock(&res->lock);
+	if (refcount > 0)
+		return;
+	pthread_mutex_destroy(&res->lock);
+	FREE_STRING(res->smtp_comment);
+	FREE_STRING(res->header_comment);
+	FREE_STRING(res->received_spf);
+	free(res);
+}
+
 static void
-request_query(request_t *req)
+request_query(request_t *req, SPF_server_t *spf_server)
 {
 	SPF_request_t	*spf_request = NULL;
 	SPF_response_t	*spf_response = NULL;
@@ -279,7 +673,17 @@ request_query(request_t *req)
 
 	spf_request = SPF_request_new(spf_server);
 
-	if (strchr(req->ip, ':')) {
+	if (req->family == AF_INET) {
+		UNLESS(SPF_request_set_ipv4(spf_request, req->ipaddr.in4)) {
+			FAIL("Setting IPv4 address");
+		}
+	}
+	else if (req->family == AF_INET6) {
+		UNLESS(SPF_request_set_ipv6(spf_request, req->ipaddr.in6)) {
+			FAIL("Setting IPv6 address");
+		}
+	}
+	else if (strchr(req->ip, ':')) {
 		UNLESS(SPF_request_set_ipv6_str(spf_request, req->ip)) {
 			FAIL("Setting IPv6 address");
 		}
@@ -356,8 +760,11 @@ ok:
 	// response_print("Result: ", spf_response);
 	(void)response_print;
 
-	req->spf_response = spf_response;
-	req->spf_request = spf_request;
+	req->result = result_new(spf_response, req->spf_err);
+	if (req->result == NULL)
+		req->spf_err = SPF_E_NO_MEMORY;
+	FREE_RESPONSE(spf_response);
+	FREE_REQUEST(spf_request);
 }
 
 /* This is needed on HP/UX, IIRC */
@@ -372,11 +779,11 @@ W(const char *c)
 static void
 request_format(request_t *req)
 {
-	SPF_response_t	*spf_response;
+	result_t	*res;
 
-	spf_response = req->spf_response;
+	res = req->result;
 
-	if (spf_response) {
+	if (res && res->have_response) {
 		req->fmtlen = snprintf(req->fmt, 4095,
 			"ip=%s\n"
 			"sender=%s\n"
@@ -386,11 +793,11 @@ request_format(request_t *req)
 			"header_comment=%s\n"
 			"error=%s\n"
 			, req->ip, req->sender
-			, W(SPF_strresult(SPF_response_result(spf_response)))
-			, W(SPF_strreason(SPF_response_reason(spf_response)))
-			, W(SPF_response_get_smtp_comment(spf_response))
-			, W(SPF_response_get_header_comment(spf_response))
-			, W(SPF_strerror(SPF_response_errcode(spf_response)))
+			, W(SPF_strresult(res->result))
+			, W(SPF_strreason(res->reason))
+			, W(res->smtp_comment)
+			, W(res->header_comment)
+			, W(SPF_strerror(res->err))
 			);
 	}
 	else {
@@ -400,22 +807,441 @@ request_format(request_t *req)
 			"result=unknown\n"
 			"error=%s\n"
 			, req->ip, req->sender
-			, SPF_strerror(req->spf_err)
+			, SPF_strerror(res ? res->err : req->spf_err)
 			);
 	}
 
 	req->fmt[4095] = '\0';
 }
 
+/*
+ * Answers a Postfix policy request. A failure is rejected, a temporary
+ * error is deferred, and anything else goes on with a Received-SPF
+ * header; if we have no answer at all, we let the message through.
+ */
 static void
-request_handle(request_t *req)
+policy_format(request_t *req)
+{
+	result_t		*res;
+	const char		*comment;
+	const char		*header;
+
+	res = req->result;
+	req->fmtlen = -1;
+
+	if (res && res->have_response) {
+		switch (res->result) {
+			case SPF_RESULT_FAIL:
+				comment = res->smtp_comment;
+				req->fmtlen = snprintf(req->fmt, 4095,
+					"action=550 5.7.1 %s\n\n",
+					comment ? comment : "SPF check failed");
+				break;
+			case SPF_RESULT_TEMPERROR:
+				req->fmtlen = snprintf(req->fmt, 4095,
+					"action=451 4.4.3 SPF temporary error\n\n");
+				break;
+			default:
+				header = res->received_spf;
+				if (header)
+					req->fmtlen = snprintf(req->fmt, 4095,
+						"action=PREPEND %s\n\n", header);
+				break;
+		}
+	}
+
+	/* A truncated action would be worse than none. */
+	if (req->fmtlen < 0 || req->fmtlen >= 4095)
+		req->fmtlen = snprintf(req->fmt, 4095, "action=DUNNO\n\n");
+}
+
+static inline unsigned char *
+bin_put16(unsigned char *p, unsigned int v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+	return p + 2;
+}
+
+static inline unsigned char *
+bin_put32(unsigned char *p, unsigned int v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+	return p + 4;
+}
+
+static inline unsigned int
+bin_get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline unsigned int
+bin_get32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Appends an optional string field to a binary response, if it fits. */
+static unsigned char *
+bin_put_field(request_t *req, unsigned char *p, unsigned char *mask,
+				unsigned int bit, const char *str)
+{
+	unsigned char	*end;
+	size_t			 len;
+
+	if (!(req->bin_mask & bit) || str == NULL)
+		return p;
+	end = (unsigned char *)req->fmt + sizeof(req->fmt);
+	len = strlen(str);
+	if (len > 0xffff || (size_t)(end - p) < 2 + len)
+		return p;
+	p = bin_put16(p, len);
+	memcpy(p, str, len);
+	*mask |= bit;
+	return p + len;
+}
+
+static void
+binary_format(request_t *req)
+{
+	result_t		*res;
+	unsigned char	*start;
+	unsigned char	*p;
+	unsigned char	*mask;
+	SPF_errcode_t	 err;
+
+	res = req->result;
+	start = (unsigned char *)req->fmt;
+	p = start + 4;
+	*p++ = SPFD_BIN_VERSION;
+	mask = p++;
+	*mask = 0;
+	p = bin_put32(p, req->bin_id);
+
+	if (res && res->have_response) {
+		*p++ = res->result;
+		*p++ = res->reason;
+		p = bin_put16(p, res->err);
+		p = bin_put_field(req, p, mask, SPFD_BIN_SMTP_COMMENT,
+				res->smtp_comment);
+		p = bin_put_field(req, p, mask, SPFD_BIN_HEADER_COMMENT,
+				res->header_comment);
+		p = bin_put_field(req, p, mask, SPFD_BIN_RECEIVED_SPF,
+				res->received_spf);
+	}
+	else {
+		/* No error means request_check() turned it down. */
+		err = res ? res->err : req->spf_err;
+		if (err == SPF_E_SUCCESS)
+			err = SPF_E_MISSING_OPT;
+		*p++ = SPF_RESULT_INVALID;
+		*p++ = SPF_REASON_NONE;
+		p = bin_put16(p, err);
+	}
+
+	bin_put32(start, p - start - 4);
+	req->fmtlen = p - start;
+}
+
+/*
+ * A request which carried an id= is answered with the same id first,
+ * and a blank line after, so that a client with several requests in
+ * flight can match the replies up as they arrive.
+ */
+static void
+request_tag(request_t *req)
+{
+	char	 tag[256];
+	int		 taglen;
+
+	taglen = snprintf(tag, sizeof(tag), "id=%s\n", req->id);
+	if (taglen >= (int)sizeof(tag) || req->fmtlen + taglen + 1 > 4095) {
+		req->fmtlen = snprintf(req->fmt, 4095,
+			"result=unknown\n"
+			"reason=Reply too long\n");
+		return;
+	}
+	memmove(req->fmt + taglen, req->fmt, req->fmtlen);
+	memcpy(req->fmt, tag, taglen);
+	req->fmtlen += taglen;
+	req->fmt[req->fmtlen++] = '\n';
+	req->fmt[req->fmtlen] = '\0';
+}
+
+/* Returns the client address of req as text; buf is used if need be. */
+static const char *
+request_addr(request_t *req, char *buf)
+{
+	if (req->family == 0)
+		return req->ip;
+	if (inet_ntop(req->family, &req->ipaddr, buf, INET6_ADDRSTRLEN) == NULL)
+		*buf = '\0';
+	return buf;
+}
+
+/*
+ * Requests are coalesced on everything which can change the answer.
+ * Returns the length of the key written to buf, which must hold
+ * SPFD_MAX_REQUEST + INET6_ADDRSTRLEN bytes.
+ */
+static size_t
+request_key(request_t *req, char *buf)
+{
+	const char	*addr;
+	char		*p;
+	size_t		 len;
+
+	addr = request_addr(req, buf);
+	len = strlen(addr) + 1;
+	memmove(buf, addr, len);	/* addr may be buf already */
+	p = buf + len;
+#define KEY_ADD(s) do { \
+		len = (s) ? strlen(s) + 1 : 1; \
+		memcpy(p, (s) ? (s) : "", len); \
+		p += len; \
+	} while (0)
+	KEY_ADD(req->helo);
+	KEY_ADD(req->sender);
+	if (spfd_config.sec_mx)
+		KEY_ADD(req->rcpt_to);
+#undef KEY_ADD
+	return p - buf;
+}
+
+static unsigned int
+flight_hash(const char *key, size_t len)
+{
+	unsigned int	 h;
+	size_t			 i;
+
+	h = 5381;
+	for (i = 0; i < len; i++)
+		h = h * 33 + (unsigned char)key[i];
+	return h;
+}
+
+static void
+flight_free(flight_t *fl)
+{
+	result_unref(fl->result);
+	free(fl->key);
+	free(fl);
+}
+
+static flight_role_t
+flight_begin(request_t *req)
+{
+	char			 key[SPFD_MAX_REQUEST + INET6_ADDRSTRLEN];
+	size_t			 keylen;
+	unsigned int	 hash;
+	flight_t		**flp;
+	flight_t		*fl;
+	time_t			 now;
+
+	keylen = request_key(req, key);
+	hash = flight_hash(key, keylen);
+	time(&now);
+
+	pthread_mutex_lock(&spfd_state.flight_lock);
+	flp = &spfd_state.flight[hash % SPFD_FLIGHT_BUCKETS];
+	while ((fl = *flp) != NULL) {
+		if (fl->result != NULL && fl->expires < now) {
+			*flp = fl->next;
+			flight_free(fl);
+			continue;
+		}
+		if (fl->hash == hash && fl->keylen == keylen
+				&& memcmp(fl->key, key, keylen) == 0)
+			break;
+		flp = &fl->next;
+	}
+
+	if (fl != NULL) {
+		if (fl->result != NULL) {
+			req->result = result_ref(fl->result);
+			pthread_mutex_unlock(&spfd_state.flight_lock);
+			return FLIGHT_MEMO;
+		}
+		req->next = fl->waiters;
+		fl->waiters = req;
+		pthread_mutex_unlock(&spfd_state.flight_lock);
+		return FLIGHT_FOLLOW;
+	}
+
+	/* If this fails, we just evaluate without sharing. */
+	fl = (flight_t *)calloc(1, sizeof(flight_t));
+	if (fl != NULL) {
+		fl->key = malloc(keylen);
+		if (fl->key == NULL) {
+			free(fl);
+			fl = NULL;
+		}
+	}
+	if (fl != NULL) {
+		memcpy(fl->key, key, keylen);
+		fl->keylen = keylen;
+		fl->hash = hash;
+		fl->generation = spfd_state.generation;
+		flp = &spfd_state.flight[hash % SPFD_FLIGHT_BUCKETS];
+		fl->next = *flp;
+		*flp = fl;
+	}
+	req->flight = fl;
+	pthread_mutex_unlock(&spfd_state.flight_lock);
+	return FLIGHT_LEAD;
+}
+
+/*
+ * The leader has its result: returns the requests which were waiting
+ * for it, and keeps the result for a while if it is worth keeping.
+ */
+static request_t *
+flight_end(request_t *req)
+{
+	request_t		*waiters;
+	flight_t		**flp;
+	flight_t		*fl;
+	flight_t		*next;
+	result_t		*res;
+	bool			 memo;
+	int				 n;
+
+	fl = req->flight;
+	if (fl == NULL)
+		return NULL;
+	req->flight = NULL;
+
+	/* A temporary error may well be gone by the next request. */
+	res = req->result;
+	memo = spfd_config.memo > 0 && res != NULL && res->have_response
+			&& res->result != SPF_RESULT_TEMPERROR;
+
+	pthread_mutex_lock(&spfd_state.flight_lock);
+	/* Nor may a result from before a reload. */
+	if (fl->generation != spfd_state.generation)
+		memo = FALSE;
+	waiters = fl->waiters;
+	fl->waiters = NULL;
+	flp = &spfd_state.flight[fl->hash % SPFD_FLIGHT_BUCKETS];
+	if (memo) {
+		fl->result = result_ref(res);
+		fl->expires = time(NULL) + spfd_config.memo;
+		/* Keep the chain short; the oldest memos go first. */
+		for (n = 0; *flp != NULL; ) {
+			next = *flp;
+			if (next->result != NULL && ++n > SPFD_MEMO_CHAIN) {
+				*flp = next->next;
+				flight_free(next);
+			}
+			else
+				flp = &next->next;
+		}
+	}
+	else {
+		while (*flp != fl)
+			flp = &(*flp)->next;
+		*flp = fl->next;
+		flight_free(fl);
+	}
+	pthread_mutex_unlock(&spfd_state.flight_lock);
+
+	return waiters;
+}
+
+/* A reload has made the remembered results stale. */
+static void
+flight_forget()
+{
+	flight_t		**flp;
+	flight_t		*fl;
+	int				 i;
+
+	pthread_mutex_lock(&spfd_state.flight_lock);
+	spfd_state.generation++;
+	for (i = 0; i < SPFD_FLIGHT_BUCKETS; i++) {
+		flp = &spfd_state.flight[i];
+		while ((fl = *flp) != NULL) {
+			if (fl->result != NULL) {
+				*flp = fl->next;
+				flight_free(fl);
+			}
+			else
+				flp = &fl->next;
+		}
+	}
+	pthread_mutex_unlock(&spfd_state.flight_lock);
+}
+
+/* Formats req->result, or the lack of it, in req's protocol. */
+static void
+request_reply(request_t *req, bool checked)
 {
-	printf("| %s\n", req->sender); fflush(stdout);
-	if (!request_check(req)) {
-		request_query(req);
+	if (req->proto == PROTO_POLICY)
+		policy_format(req);
+	else if (req->proto == PROTO_BINARY)
+		binary_format(req);
+	else if (checked)
 		request_format(req);
+	/* else request_check() has said what was wrong. */
+	if (req->id)
+		request_tag(req);
+}
+
+static void stats_evaluation(double seconds, dns_count_t *count);
+static double stats_since(const struct timespec *start);
+static server_t *server_get(void);
+static void server_put(server_t *server);
+
+/* Runs request_query(), and notes how long it took and what it asked. */
+static void
+request_evaluate(request_t *req)
+{
+	dns_count_t		*count;
+	struct timespec	 start;
+	server_t		*server;
+
+	count = (dns_count_t *)pthread_getspecific(spfd_state.dns_key);
+	memset(count, 0, sizeof(*count));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	server = server_get();
+	request_query(req, server->spf_server);
+	server_put(server);
+	stats_evaluation(stats_since(&start), count);
+}
+
+/*
+ * Returns FALSE if req has been handed to an evaluation already
+ * running for an identical request; flight_end() will return it.
+ */
+static bool
+request_handle(request_t *req)
+{
+	if (spfd_config.debug) {
+		printf("| %s\n", req->sender);
+		fflush(stdout);
+	}
+	if (request_check(req)) {
+		request_reply(req, FALSE);
+		return TRUE;
+	}
+	req->role = flight_begin(req);
+	switch (req->role) {
+		case FLIGHT_FOLLOW:
+			return FALSE;
+		case FLIGHT_LEAD:
+			request_evaluate(req);
+			break;
+		case FLIGHT_MEMO:
+		case FLIGHT_NONE:
+			break;
 	}
+	request_reply(req, TRUE);
 	// printf("==\n%s\n", req->fmt);
+	return TRUE;
 }
 
 static const struct option longopts[] = {
@@ -423,6 +1249,12 @@ static const struct option longopts[] = {
 	{ "tcpport",	required_argument,	NULL,	't', },
 	{ "udpport",	required_argument,	NULL,	'p', },
 	{ "path",		required_argument,	NULL,	'f', },
+	{ "policyport",	required_argument,	NULL,	'T', },
+	{ "policypath",	required_argument,	NULL,	'F', },
+	{ "binport",	required_argument,	NULL,	'B', },
+	{ "binpath",	required_argument,	NULL,	'b', },
+	{ "statsport",	required_argument,	NULL,	'S', },
+	{ "statspath",	required_argument,	NULL,	's', },
 #ifdef HAVE_PWD_H
 	{ "pathuser",	required_argument,	NULL,	'x', },
 #endif
@@ -437,17 +1269,31 @@ static const struct option longopts[] = {
 	{ "setgroup",	required_argument,	NULL,	'g', },
 #endif
 	{ "onerequest",	no_argument,		NULL,	'o', },
+	{ "workers",	required_argument,	NULL,	'w', },
+	{ "queue",		required_argument,	NULL,	'q', },
+	{ "listeners",	required_argument,	NULL,	'l', },
+	{ "pipeline",	required_argument,	NULL,	'P', },
+	{ "memo",		required_argument,	NULL,	'M', },
+	{ "config",		required_argument,	NULL,	'C', },
+	{ "inflight",	required_argument,	NULL,	'i', },
+	{ "perip",		required_argument,	NULL,	'r', },
 	{ "help",       no_argument,		NULL,	'h', },
 	{ 0, 0, 0, 0 },
 };
 
-static const char *shortopts = "d:t:p:f:x:y:m:u:g:o:h:";
+static const char *shortopts = "d:t:p:f:T:F:B:b:S:s:x:y:m:u:g:o:w:q:l:P:M:C:i:r:h:";
 
 void usage (void) {
 	fprintf(stdout,"Flags\n");
 	fprintf(stdout,"\t-tcpport\n");
 	fprintf(stdout,"\t-udpport\n");
 	fprintf(stdout,"\t-path\n");
+	fprintf(stdout,"\t-policyport\n");
+	fprintf(stdout,"\t-policypath\n");
+	fprintf(stdout,"\t-binport\n");
+	fprintf(stdout,"\t-binpath\n");
+	fprintf(stdout,"\t-statsport\n");
+	fprintf(stdout,"\t-statspath\n");
 #ifdef HAVE_PWD_H
 	fprintf(stdout,"\t-pathuser\n");
 #endif
@@ -462,6 +1308,14 @@ void usage (void) {
 	fprintf(stdout,"\t-setgroup\n");
 #endif
 	fprintf(stdout,"\t-onerequest\n");
+	fprintf(stdout,"\t-workers\n");
+	fprintf(stdout,"\t-queue\n");
+	fprintf(stdout,"\t-listeners\n");
+	fprintf(stdout,"\t-pipeline\n");
+	fprintf(stdout,"\t-memo\n");
+	fprintf(stdout,"\t-config\n");
+	fprintf(stdout,"\t-inflight\n");
+	fprintf(stdout,"\t-perip\n");
 	fprintf(stdout,"\t-help\n");
 
 }
@@ -509,6 +1363,10 @@ daemon_config(int argc, char *argv[])
 	char	 c;
 
 	memset(&spfd_config, 0, sizeof(spfd_config));
+	spfd_config.workers = SPFD_WORKERS;
+	spfd_config.queue = SPFD_QUEUE;
+	spfd_config.listeners = 1;
+	spfd_config.pipeline = SPFD_PIPELINE;
 
 	while ((c =
 		getopt_long(argc, argv, shortopts, longopts, &idx)
@@ -523,6 +1381,24 @@ daemon_config(int argc, char *argv[])
 			case 'f':
 				spfd_config.path = optarg;
 				break;
+			case 'T':
+				spfd_config.policyport = atol(optarg);
+				break;
+			case 'F':
+				spfd_config.policypath = optarg;
+				break;
+			case 'B':
+				spfd_config.binport = atol(optarg);
+				break;
+			case 'b':
+				spfd_config.binpath = optarg;
+				break;
+			case 'S':
+				spfd_config.statsport = atol(optarg);
+				break;
+			case 's':
+				spfd_config.statspath = optarg;
+				break;
 
 			case 'd':
 				spfd_config.debug = atol(optarg);
@@ -557,6 +1433,39 @@ daemon_config(int argc, char *argv[])
 				spfd_config.onerequest = 1;
 				fprintf(stdout, "One request mode\n");
 				break;
+			case 'w':
+				spfd_config.workers = atol(optarg);
+				if (spfd_config.workers < 1)
+					DIE("Need at least one worker");
+				break;
+			case 'q':
+				spfd_config.queue = atol(optarg);
+				if (spfd_config.queue < 1)
+					DIE("Need a queue of at least one request");
+				break;
+			case 'l':
+				spfd_config.listeners = atol(optarg);
+				if (spfd_config.listeners < 1
+						|| spfd_config.listeners > SPFD_MAX_LISTENERS)
+					DIE("Invalid number of listeners");
+				break;
+			case 'P':
+				spfd_config.pipeline = atol(optarg);
+				if (spfd_config.pipeline < 1)
+					DIE("Need at least one request per connection");
+				break;
+			case 'M':
+				spfd_config.memo = atol(optarg);
+				break;
+			case 'C':
+				spfd_config.config = optarg;
+				break;
+			case 'i':
+				spfd_config.inflight = atol(optarg);
+				break;
+			case 'r':
+				spfd_config.perip = atol(optarg);
+				break;
 
 			case 0:
 			case '?':
@@ -575,6 +1484,29 @@ daemon_config(int argc, char *argv[])
 	}
 }
 
+/*
+ * With several listeners, each gets its own socket on the same port,
+ * and the kernel spreads the load across them.
+ */
+static void
+daemon_reuseport(int sock)
+{
+#ifdef SO_REUSEPORT
+	int					 optval;
+
+	if (spfd_config.listeners > 1) {
+		optval = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+						&optval, sizeof(optval)) < 0) {
+			perror("setsockopt");
+			DIE("Failed to set SO_REUSEPORT");
+		}
+	}
+#else
+	(void)sock;
+#endif
+}
+
 static int
 daemon_bind_inet_udp()
 {
@@ -585,6 +1517,7 @@ daemon_bind_inet_udp()
 		perror("socket");
 		DIE("Failed to create socket");
 	}
+	daemon_reuseport(sock);
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(spfd_config.udpport);
@@ -600,7 +1533,7 @@ daemon_bind_inet_udp()
 }
 
 static int
-daemon_bind_inet_tcp()
+daemon_bind_inet_tcp(int port, in_addr_t bindaddr)
 {
 	struct sockaddr_in	 addr;
 	int					 sock;
@@ -616,28 +1549,29 @@ daemon_bind_inet_tcp()
 	optval = 1;
 	optlen = sizeof(int);
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, optlen);
+	daemon_reuseport(sock);
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(spfd_config.tcpport);
-	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = bindaddr;
 	if (bind(sock, (struct sockaddr *)(&addr), sizeof(addr)) < 0) {
 		perror("bind");
 		DIE("Failed to bind socket");
 	}
 
-	if (listen(sock, 5) < 0) {
+	if (listen(sock, SOMAXCONN) < 0) {
 		perror("listen");
 		DIE("Failed to listen on socket");
 	}
 
-	fprintf(stderr, "Accepting connections on %d\n", spfd_config.tcpport);
+	fprintf(stderr, "Accepting connections on %d\n", port);
 
 	return sock;
 }
 
 static int
-daemon_bind_unix()
+daemon_bind_unix(const char *path)
 {
 	struct sockaddr_un	 addr;
 	int					 sock;
@@ -648,8 +1582,8 @@ daemon_bind_unix()
 	}
 	memset(&addr, 0, sizeof(addr));
 	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, spfd_config.path, sizeof(addr.sun_path) - 1);
-	if (unlink(spfd_config.path) < 0) {
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (unlink(path) < 0) {
 		if (errno != ENOENT) {
 			perror("unlink");
 			DIE("Failed to unlink socket");
@@ -659,76 +1593,482 @@ daemon_bind_unix()
 		perror("bind");
 		DIE("Failed to bind socket");
 	}
-	if (listen(sock, 5) < 0) {
+	if (listen(sock, SOMAXCONN) < 0) {
 		perror("listen");
 		DIE("Failed to listen on socket");
 	}
 
-	fprintf(stderr, "Accepting connections on %s\n", spfd_config.path);
+	fprintf(stderr, "Accepting connections on %s\n", path);
 
 	return sock;
 }
 
-static void
-daemon_init()
+static void stats_init(stats_t *stats);
+
+/*
+ * Two pass-through DNS layers, one either side of the cache, count
+ * the lookups each worker's evaluation makes and how many of them the
+ * cache could not answer.
+ */
+
+static SPF_dns_rr_t *
+stats_dns_lookup(SPF_dns_server_t *spf_dns_server,
+				const char *domain, ns_type rr_type, int should_cache)
 {
-	SPF_response_t	*spf_response = NULL;
-	SPF_errcode_t	 err;
+	dns_count_t	*count;
 
-	memset(&spfd_state, 0, sizeof(spfd_state));
+	count = (dns_count_t *)pthread_getspecific(spfd_state.dns_key);
+	if (count != NULL)
+		count->lookups++;
+	return SPF_dns_lookup(spf_dns_server->layer_below,
+					domain, rr_type, should_cache);
+}
 
-	spf_server = SPF_server_new(SPF_DNS_CACHE, spfd_config.debug);
+static SPF_dns_rr_t *
+stats_dns_query(SPF_dns_server_t *spf_dns_server,
+				const char *domain, ns_type rr_type, int should_cache)
+{
+	dns_count_t	*count;
 
-	if (spfd_config.rec_dom) {
-		UNLESS(SPF_server_set_rec_dom(spf_server,
-						spfd_config.rec_dom)) {
-			DIE("Failed to set receiving domain name");
-		}
-	}
+	count = (dns_count_t *)pthread_getspecific(spfd_state.dns_key);
+	if (count != NULL)
+		count->queries++;
+	return SPF_dns_lookup(spf_dns_server->layer_below,
+					domain, rr_type, should_cache);
+}
 
-	if (spfd_config.sanitize) {
-		UNLESS(SPF_server_set_sanitize(spf_server,
-						spfd_config.sanitize)) {
-			DIE("Failed to set server sanitize flag");
-		}
-	}
+static void
+stats_dns_free(SPF_dns_server_t *spf_dns_server)
+{
+	free(spf_dns_server);
+}
 
-	if (spfd_config.max_lookup) {
-		UNLESS(SPF_server_set_max_dns_mech(spf_server,
-						spfd_config.max_lookup)){
-			DIE("Failed to set maximum DNS requests");
-		}
-	}
+static SPF_dns_server_t *
+stats_dns_new(SPF_dns_server_t *layer_below, SPF_dns_lookup_t lookup,
+				const char *name)
+{
+	SPF_dns_server_t	*spf_dns_server;
+
+	spf_dns_server = (SPF_dns_server_t *)calloc(1, sizeof(SPF_dns_server_t));
+	if (spf_dns_server == NULL)
+		DIE("Failed to create DNS layer");
+	spf_dns_server->destroy = stats_dns_free;
+	spf_dns_server->lookup = lookup;
+	spf_dns_server->layer_below = layer_below;
+	spf_dns_server->name = name;
+	spf_dns_server->debug = spfd_config.debug;
+	return spf_dns_server;
+}
 
-	if (spfd_config.localpolicy) {
-		UNLESS(SPF_server_set_localpolicy(spf_server,
-						spfd_config.localpolicy,
-						spfd_config.use_trusted,
+/* What SPF_server_new(SPF_DNS_CACHE) would make, with the counters. */
+static SPF_dns_server_t *
+stats_dns_chain()
+{
+	SPF_dns_server_t	*dns;
+
+	dns = SPF_dns_resolv_new(NULL, NULL, spfd_config.debug);
+	if (dns == NULL)
+		DIE("Failed to create DNS resolver");
+	dns = stats_dns_new(dns, stats_dns_query, "queries");
+	dns = SPF_dns_cache_new(dns, NULL, spfd_config.debug, 8);
+	if (dns == NULL)
+		DIE("Failed to create DNS cache");
+	return stats_dns_new(dns, stats_dns_lookup, "lookups");
+}
+
+/*
+ * Reading the settings, and making servers of them. A reload reads
+ * the file again into a new server; if that fails, the old one stays.
+ */
+
+typedef
+enum {
+	SETTING_STRING,
+	SETTING_INT,
+	SETTING_BOOL,
+} setting_type_t;
+
+static const struct {
+	const char		*name;
+	setting_type_t	 type;
+	size_t			 offset;
+} server_settings[] = {
+	{ "rec_dom",			SETTING_STRING,
+				offsetof(server_config_t, rec_dom) },
+	{ "sanitize",			SETTING_BOOL,
+				offsetof(server_config_t, sanitize) },
+	{ "max_lookup",			SETTING_INT,
+				offsetof(server_config_t, max_lookup) },
+	{ "localpolicy",		SETTING_STRING,
+				offsetof(server_config_t, localpolicy) },
+	{ "use_trusted",		SETTING_BOOL,
+				offsetof(server_config_t, use_trusted) },
+	{ "explanation",		SETTING_STRING,
+				offsetof(server_config_t, explanation) },
+	{ "result_cache",		SETTING_INT,
+				offsetof(server_config_t, result_cache) },
+	{ "result_cache_ttl",	SETTING_INT,
+				offsetof(server_config_t, result_cache_ttl) },
+	{ "exp_cache",			SETTING_INT,
+				offsetof(server_config_t, exp_cache) },
+	{ "exp_cache_ttl",		SETTING_INT,
+				offsetof(server_config_t, exp_cache_ttl) },
+};
+
+static void
+server_config_free(server_config_t *sc)
+{
+	FREE_STRING(sc->rec_dom);
+	FREE_STRING(sc->localpolicy);
+	FREE_STRING(sc->explanation);
+}
+
+/* Sets the named setting from value; returns FALSE if it cannot. */
+static bool
+server_config_set(server_config_t *sc, const char *name, const char *value)
+{
+	char	*field;
+	char	*end;
+	long	 n;
+	size_t	 i;
+
+	for (i = 0; i < sizeof(server_settings) / sizeof(*server_settings); i++)
+		if (strcmp(server_settings[i].name, name) == 0)
+			break;
+	if (i == sizeof(server_settings) / sizeof(*server_settings))
+		return FALSE;
+
+	field = (char *)sc + server_settings[i].offset;
+	switch (server_settings[i].type) {
+		case SETTING_STRING:
+			FREE_STRING(*(char **)field);
+			*(char **)field = strdup(value);
+			return *(char **)field != NULL;
+		case SETTING_INT:
+			n = strtol(value, &end, 10);
+			if (*value == '\0' || *end != '\0' || n < 0 || n > INT_MAX)
+				return FALSE;
+			*(int *)field = n;
+			return TRUE;
+		case SETTING_BOOL:
+			if (strcmp(value, "1") == 0 || strcmp(value, "yes") == 0)
+				*(bool *)field = TRUE;
+			else if (strcmp(value, "0") == 0 || strcmp(value, "no") == 0)
+				*(bool *)field = FALSE;
+			else
+				return FALSE;
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Reads path, if there is one, into sc. Each line is a setting name,
+ * white space, and the value, which runs to the end of the line.
+ * Blank lines and lines starting with '#' are ignored.
+ */
+static bool
+server_config_read(const char *path, server_config_t *sc)
+{
+	FILE	*fp;
+	char	 line[SPFD_MAX_REQUEST];
+	char	*name;
+	char	*value;
+	char	*p;
+	int		 lineno;
+	bool	 ok;
+
+	memset(sc, 0, sizeof(*sc));
+	sc->result_cache_ttl = SPFD_RESULT_CACHE_TTL;
+	sc->exp_cache = SPF_EXP_CACHE_BITS;
+	sc->exp_cache_ttl = SPF_EXP_CACHE_MAX_TTL;
+	if (path == NULL)
+		return TRUE;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return FALSE;
+	}
+	ok = TRUE;
+	for (lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++) {
+		p = line + strlen(line);
+		while (p > line && isspace((unsigned char)p[-1]))
+			*--p = '\0';
+		for (name = line; isspace((unsigned char)*name); name++)
+			;
+		if (*name == '\0' || *name == '#')
+			continue;
+		value = name + strcspn(name, " \t");
+		if (*value != '\0')
+			*value++ = '\0';
+		while (isspace((unsigned char)*value))
+			value++;
+		if (!server_config_set(sc, name, value)) {
+			fprintf(stderr, "%s:%d: Invalid setting %s\n",
+							path, lineno, name);
+			ok = FALSE;
+		}
+	}
+	fclose(fp);
+	return ok;
+}
+
+/* Makes a server with the settings in path, or returns NULL. */
+static server_t *
+server_new(const char *path)
+{
+	server_config_t	 sc;
+	server_t		*server;
+	SPF_server_t	*spf_server;
+	SPF_response_t	*spf_response = NULL;
+	SPF_errcode_t	 err;
+
+	server = NULL;
+	spf_server = NULL;
+	if (!server_config_read(path, &sc))
+		goto fail;
+
+	/* The DNS layers are shared, so they are not freed with it. */
+	spf_server = SPF_server_new_dns(spfd_state.resolver, spfd_config.debug);
+	if (spf_server == NULL)
+		goto fail;
+
+	if (sc.rec_dom) {
+		UNLESS(SPF_server_set_rec_dom(spf_server, sc.rec_dom)) {
+			fprintf(stderr, "Failed to set receiving domain name\n");
+			goto fail;
+		}
+	}
+
+	if (sc.sanitize) {
+		UNLESS(SPF_server_set_sanitize(spf_server, sc.sanitize)) {
+			fprintf(stderr, "Failed to set server sanitize flag\n");
+			goto fail;
+		}
+	}
+
+	if (sc.max_lookup) {
+		UNLESS(SPF_server_set_max_dns_mech(spf_server, sc.max_lookup)) {
+			fprintf(stderr, "Failed to set maximum DNS requests\n");
+			goto fail;
+		}
+	}
+
+	if (sc.localpolicy) {
+		UNLESS(SPF_server_set_localpolicy(spf_server,
+						sc.localpolicy, sc.use_trusted,
 						&spf_response)){
 			response_print_errors("Compiling local policy",
 							spf_response, err);
-			DIE("Failed to set local policy");
+			fprintf(stderr, "Failed to set local policy\n");
+			goto fail;
 		}
 		FREE_RESPONSE(spf_response);
 	}
 
-	if (spfd_config.explanation) {
+	if (sc.explanation) {
 		UNLESS(SPF_server_set_explanation(spf_server,
-						spfd_config.explanation,
-						&spf_response)){
+						sc.explanation, &spf_response)){
 			response_print_errors("Setting default explanation",
 							spf_response, err);
-			DIE("Failed to set default explanation");
+			fprintf(stderr, "Failed to set default explanation\n");
+			goto fail;
 		}
 		FREE_RESPONSE(spf_response);
 	}
 
-	if (spfd_config.udpport)
-		spfd_state.sock_udp = daemon_bind_inet_udp();
-	if (spfd_config.tcpport)
-		spfd_state.sock_tcp = daemon_bind_inet_tcp();
+	UNLESS(SPF_server_set_result_cache(spf_server,
+					sc.result_cache, sc.result_cache_ttl)) {
+		fprintf(stderr, "Failed to set up the result cache\n");
+		goto fail;
+	}
+
+	if (sc.exp_cache != SPF_EXP_CACHE_BITS
+			|| sc.exp_cache_ttl != SPF_EXP_CACHE_MAX_TTL) {
+		UNLESS(SPF_server_set_exp_cache(spf_server,
+						sc.exp_cache, sc.exp_cache_ttl)) {
+			fprintf(stderr, "Failed to set up the explanation cache\n");
+			goto fail;
+		}
+	}
+
+	/* Policy and explanation have been linted; now just evaluate. */
+	UNLESS(SPF_server_set_compile_mode(spf_server,
+					SPF_COMPILE_PRODUCTION)) {
+		fprintf(stderr, "Failed to set compile mode\n");
+		goto fail;
+	}
+
+	server = (server_t *)calloc(1, sizeof(server_t));
+	if (server == NULL)
+		goto fail;
+	server->refcount = 1;
+	server->spf_server = spf_server;
+	server_config_free(&sc);
+	return server;
+
+fail:
+	FREE_RESPONSE(spf_response);
+	if (spf_server)
+		SPF_server_free(spf_server);
+	server_config_free(&sc);
+	return NULL;
+}
+
+/* Returns a reference to the current server. */
+static server_t *
+server_get()
+{
+	server_t	*server;
+
+	pthread_mutex_lock(&spfd_state.server_lock);
+	server = spfd_state.server;
+	server->refcount++;
+	pthread_mutex_unlock(&spfd_state.server_lock);
+	return server;
+}
+
+static void
+server_put(server_t *server)
+{
+	SPF_server_stats_t	 st;
+	stats_t				*stats = &spfd_state.stats;
+	int					 refcount;
+
+	pthread_mutex_lock(&spfd_state.server_lock);
+	refcount = --server->refcount;
+	pthread_mutex_unlock(&spfd_state.server_lock);
+	if (refcount > 0)
+		return;
+
+	/* The reload counted it up to the swap; add what came after. */
+	SPF_server_get_stats(server->spf_server, &st);
+	pthread_mutex_lock(&stats->lock);
+	stats->retired.result_hits += st.result_hits
+					- server->counted.result_hits;
+	stats->retired.result_misses += st.result_misses
+					- server->counted.result_misses;
+	stats->retired.exp_hits += st.exp_hits - server->counted.exp_hits;
+	stats->retired.exp_misses += st.exp_misses
+					- server->counted.exp_misses;
+	pthread_mutex_unlock(&stats->lock);
+
+	SPF_server_free(server->spf_server);
+	free(server);
+}
+
+static void
+server_reload()
+{
+	server_t	*server;
+	server_t	*old;
+
+	server = server_new(spfd_config.config);
+	pthread_mutex_lock(&spfd_state.stats.lock);
+	if (server)
+		spfd_state.stats.reloads++;
+	else
+		spfd_state.stats.reload_failures++;
+	pthread_mutex_unlock(&spfd_state.stats.lock);
+	if (server == NULL) {
+		fprintf(stderr, "Reload failed; keeping the old settings\n");
+		return;
+	}
+
+	/*
+	 * Count the old server's cache use in stats.retired as it leaves,
+	 * under server_lock, so that stats_format() sees it either there
+	 * or as the current server, and the counters never go backwards.
+	 */
+	pthread_mutex_lock(&spfd_state.server_lock);
+	old = spfd_state.server;
+	spfd_state.server = server;
+	SPF_server_get_stats(old->spf_server, &old->counted);
+	pthread_mutex_lock(&spfd_state.stats.lock);
+	spfd_state.stats.retired.result_hits += old->counted.result_hits;
+	spfd_state.stats.retired.result_misses += old->counted.result_misses;
+	spfd_state.stats.retired.exp_hits += old->counted.exp_hits;
+	spfd_state.stats.retired.exp_misses += old->counted.exp_misses;
+	pthread_mutex_unlock(&spfd_state.stats.lock);
+	pthread_mutex_unlock(&spfd_state.server_lock);
+	/* Evaluations still using the old server keep it until they finish. */
+	server_put(old);
+	flight_forget();
+	fprintf(stderr, "Reloaded settings\n");
+}
+
+/* Every other thread blocks SIGHUP, so this one gets it. */
+static void *
+server_signal_main(void *arg)
+{
+	sigset_t	 set;
+	int			 sig;
+
+	(void)arg;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	for (;;) {
+		if (sigwait(&set, &sig) == 0 && sig == SIGHUP)
+			server_reload();
+	}
+	return NULL;
+}
+
+static void
+daemon_init()
+{
+	int				 i;
+
+	memset(&spfd_state, 0, sizeof(spfd_state));
+	stats_init(&spfd_state.stats);
+
+	/* A client may hang up before we answer. */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_mutex_init(&spfd_state.server_lock, NULL);
+	spfd_state.resolver = stats_dns_chain();
+	spfd_state.server = server_new(spfd_config.config);
+	if (spfd_state.server == NULL)
+		DIE("Failed to configure SPF server");
+
+	for (i = 0; i < spfd_config.listeners; i++) {
+#ifndef SO_REUSEPORT
+		/* All the listeners have to share one socket. */
+		if (i > 0) {
+			spfd_state.sock_udp[i] = spfd_state.sock_udp[0];
+			spfd_state.sock_tcp[i] = spfd_state.sock_tcp[0];
+			continue;
+		}
+#endif
+		if (spfd_config.udpport)
+			spfd_state.sock_udp[i] = daemon_bind_inet_udp();
+		if (spfd_config.tcpport)
+			spfd_state.sock_tcp[i] =
+							daemon_bind_inet_tcp(spfd_config.tcpport,
+								INADDR_ANY);
+	}
 	if (spfd_config.path)
-		spfd_state.sock_unix = daemon_bind_unix();
+		spfd_state.sock_unix = daemon_bind_unix(spfd_config.path);
+	if (spfd_config.policyport)
+		spfd_state.sock_policy_tcp =
+				daemon_bind_inet_tcp(spfd_config.policyport, INADDR_ANY);
+	if (spfd_config.policypath)
+		spfd_state.sock_policy_unix =
+						daemon_bind_unix(spfd_config.policypath);
+	if (spfd_config.binport)
+		spfd_state.sock_bin_tcp =
+				daemon_bind_inet_tcp(spfd_config.binport, INADDR_ANY);
+	if (spfd_config.binpath)
+		spfd_state.sock_bin_unix =
+						daemon_bind_unix(spfd_config.binpath);
+	/* Metrics are for the local host only. */
+	if (spfd_config.statsport)
+		spfd_state.sock_stats_tcp = daemon_bind_inet_tcp(
+				spfd_config.statsport, htonl(INADDR_LOOPBACK));
+	if (spfd_config.statspath)
+		spfd_state.sock_stats_unix =
+						daemon_bind_unix(spfd_config.statspath);
 	/* XXX Die if none of the above. */
 }
 
@@ -747,27 +2087,139 @@ find_field(request_t *req, const char *key)
 		return &req->sender;
 	if (STREQ(key, "rcpt"))
 		return &req->rcpt_to;
+	if (STREQ(key, "id"))
+		return &req->id;
 	fprintf(stderr, "Invalid key %s\n", key);
 	return NULL;
 }
 
-/* This is called with req->data malloc'd */
-static void *
-handle_datagram(void *arg)
+/* Postfix sends many attributes; we ignore those we do not use. */
+static char **
+policy_find_field(request_t *req, const char *key)
+{
+	if (STREQ(key, "client_address"))
+		return &req->ip;
+	if (STREQ(key, "helo_name"))
+		return &req->helo;
+	if (STREQ(key, "sender"))
+		return &req->sender;
+	if (STREQ(key, "recipient"))
+		return &req->rcpt_to;
+	return NULL;
+}
+
+static request_t *
+request_new(loop_t *loop, conn_t *conn)
 {
 	request_t	*req;
+
+	req = (request_t *)calloc(1, sizeof(request_t));
+	if (req == NULL)
+		return NULL;
+	req->loop = loop;
+	req->conn = conn;
+	return req;
+}
+
+static void
+request_free(request_t *req)
+{
+	result_unref(req->result);
+	FREE_STRING(req->data);
+	free(req);
+}
+
+/*
+ * Takes a u16 length-prefixed string off *pp, and NUL terminates it by
+ * moving it back over its length. Returns NULL if it runs past end.
+ */
+static char *
+bin_get_string(unsigned char **pp, unsigned char *end)
+{
+	unsigned char	*p;
+	size_t			 len;
+
+	p = *pp;
+	if (end - p < 2)
+		return NULL;
+	len = bin_get16(p);
+	if ((size_t)(end - p - 2) < len)
+		return NULL;
+	memmove(p, p + 2, len);
+	p[len] = '\0';
+	*pp = p + 2 + len;
+	return (char *)p;
+}
+
+/* Decodes a binary request; a malformed one is answered with an error. */
+static void
+binary_parse(request_t *req)
+{
+	unsigned char	*p;
+	unsigned char	*end;
+	int				 family;
+
+	p = (unsigned char *)req->data;
+	end = p + req->datalen;
+
+	if (end - p < 7 || p[0] != SPFD_BIN_VERSION)
+		goto bad;
+	req->bin_mask = p[1];
+	req->bin_id = bin_get32(p + 2);
+	p += 7;
+	switch (p[-1]) {
+		case 4:
+			family = AF_INET;
+			if (end - p < 4)
+				goto bad;
+			memcpy(&req->ipaddr.in4, p, 4);
+			p += 4;
+			break;
+		case 6:
+			family = AF_INET6;
+			if (end - p < 16)
+				goto bad;
+			memcpy(&req->ipaddr.in6, p, 16);
+			p += 16;
+			break;
+		default:
+			goto bad;
+	}
+
+	req->helo = bin_get_string(&p, end);
+	req->sender = bin_get_string(&p, end);
+	req->rcpt_to = bin_get_string(&p, end);
+	if (req->rcpt_to == NULL)
+		goto bad;
+	if (*req->helo == '\0')
+		req->helo = NULL;
+	if (*req->rcpt_to == '\0')
+		req->rcpt_to = NULL;
+	req->family = family;
+	return;
+
+bad:
+	req->helo = req->sender = req->rcpt_to = NULL;
+	req->spf_err = SPF_E_INVALID_OPT;
+}
+
+/* Splits req->data, which must be NUL terminated, into its fields. */
+static void
+request_parse(request_t *req)
+{
 	char		**fp;
 	char		*key;
 	char		*value;
 	char		*end;
-	int			 err;
-
-	req = (request_t *)arg;
-	key = req->data;
+	char		*data_end;
 
-	// printf("req: %s\n", key);
+	if (req->proto == PROTO_BINARY) {
+		binary_parse(req);
+		return;
+	}
 
-	while (key < (req->data + req->datalen)) {
+	data_end = req->data + req->datalen;
+	for (key = req->data; key < data_end; key = end + 1) {
 		end = key + strcspn(key, "\r\n");
 		*end = '\0';
 		value = strchr(key, '=');
@@ -777,191 +2229,1541 @@ handle_datagram(void *arg)
 			continue;
 
 		*value++ = '\0';
-		fp = find_field(req, key);
+		if (req->proto == PROTO_POLICY)
+			fp = policy_find_field(req, key);
+		else
+			fp = find_field(req, key);
 		if (fp != NULL)
 			*fp = value;
 		else
 			/* warned already */ ;
-
-		key = end + 1;
-		while (key < (req->data + req->datalen)) {
-			if (strchr("\r\n", *key))
-				key++;
-			else
-				break;
-		}
 	}
+}
 
-	request_handle(req);
 
-#ifdef DEBUG
-	printf("Target address length is %d: %s:%d\n", req->addrlen,
-					inet_ntoa(req->addr.in.sin_addr),
-					req->addr.in.sin_port);
-#endif
+/*
+ * Metrics, in the Prometheus text format. The workers and loops count
+ * under one lock, once per request answered and once per evaluation.
+ */
 
-	printf("- %s\n", req->sender); fflush(stdout);
-	err = sendto(req->sock, req->fmt, req->fmtlen, 0,
-			(struct sockaddr *)(&req->addr.in), req->addrlen);
-	if (err == -1)
-		perror("sendto");
+static const char *stats_protos[] = { "text", "policy", "binary" };
 
-	FREE_RESPONSE(req->spf_response);
-	FREE_REQUEST(req->spf_request);
+static const double stats_seconds[] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
 
-	FREE_STRING(req->data);
-	free(arg);
-	return NULL;
+static const double stats_lookups[] = {
+	0, 1, 2, 3, 4, 5, 6, 8, 10, 15, 20,
+};
+
+static void
+hist_init(hist_t *hist, const double *bounds, int nbounds)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->bounds = bounds;
+	hist->nbounds = nbounds;
 }
 
-/* Only req is malloc'd in this. */
-static void *
-handle_stream(void *arg)
+static void
+hist_observe(hist_t *hist, double value)
 {
-	request_t	*req;
-	char		**fp;
-	FILE		*stream;
-	char		 key[BUFSIZ];
-	char		*value;
-	char		*end;
+	int		 i;
+
+	for (i = 0; i < hist->nbounds; i++)
+		if (value <= hist->bounds[i])
+			break;
+	hist->bucket[i]++;
+	hist->count++;
+	hist->sum += value;
+}
 
-	req = (request_t *)arg;
-	stream = fdopen(req->sock, "r");
+static void
+stats_init(stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_init(&stats->lock, NULL);
+	hist_init(&stats->request_seconds, stats_seconds,
+					sizeof(stats_seconds) / sizeof(*stats_seconds));
+	hist_init(&stats->evaluation_seconds, stats_seconds,
+					sizeof(stats_seconds) / sizeof(*stats_seconds));
+	hist_init(&stats->evaluation_lookups, stats_lookups,
+					sizeof(stats_lookups) / sizeof(*stats_lookups));
+	if (pthread_key_create(&spfd_state.dns_key, NULL) != 0)
+		DIE("Failed to create thread key");
+}
 
-	do {
-		while (fgets(key, BUFSIZ, stream) != NULL) {
-			key[strcspn(key, "\r\n")] = '\0';
+static double
+stats_since(const struct timespec *start)
+{
+	struct timespec	 now;
 
-			/* Break on a blank line and permit another query */
-			if (*key == '\0')
-				break;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+			+ (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-			end = key + strcspn(key, "\r\n");
-			*end = '\0';
-			value = strchr(key, '=');
+/* A worker has answered req. */
+static void
+stats_done(request_t *req)
+{
+	stats_t		*stats = &spfd_state.stats;
+	double		 seconds;
+
+	seconds = stats_since(&req->start);
+	pthread_mutex_lock(&stats->lock);
+	stats->requests[req->proto]++;
+	if (req->result && req->result->have_response)
+		stats->results[req->result->result]++;
+	else
+		stats->unknown++;
+	if (req->role == FLIGHT_MEMO)
+		stats->memo++;
+	else if (req->role == FLIGHT_FOLLOW)
+		stats->coalesced++;
+	hist_observe(&stats->request_seconds, seconds);
+	pthread_mutex_unlock(&stats->lock);
+}
 
-			if (!value)	/* XXX WARN */
-				continue;
+/* A loop has turned req away. */
+static void
+stats_shed(request_t *req)
+{
+	stats_t		*stats = &spfd_state.stats;
 
-			*value++ = '\0';
-			fp = find_field(req, key);
-			if (fp != NULL)
-				*fp = strdup(value);
-			else
-				/* warned already */ ;
-		}
+	pthread_mutex_lock(&stats->lock);
+	stats->requests[req->proto]++;
+	stats->shed++;
+	pthread_mutex_unlock(&stats->lock);
+}
 
-		request_handle(req);
+static void
+stats_evaluation(double seconds, dns_count_t *count)
+{
+	stats_t		*stats = &spfd_state.stats;
+
+	pthread_mutex_lock(&stats->lock);
+	stats->evaluations++;
+	stats->dns_lookups += count->lookups;
+	stats->dns_queries += count->queries;
+	hist_observe(&stats->evaluation_seconds, seconds);
+	hist_observe(&stats->evaluation_lookups, count->lookups);
+	pthread_mutex_unlock(&stats->lock);
+}
 
-		printf("- %s\n", req->sender); fflush(stdout);
-		send(req->sock, req->fmt, req->fmtlen, 0);
+/* A growing buffer for the metrics text. */
+typedef
+struct _text_t {
+	char		*buf;
+	size_t		 len;
+	size_t		 size;
+} text_t;
 
-		FREE_STRING(req->ip);
-		FREE_STRING(req->helo);
-		FREE_STRING(req->sender);
-		FREE_STRING(req->rcpt_to);
-	} while (! (spfd_config.onerequest || feof(stream)));
+static void
+text_printf(text_t *text, const char *fmt, ...)
+				__attribute__((format(printf, 2, 3)));
 
-	shutdown(req->sock, SHUT_RDWR);
-	fclose(stream);
+static void
+text_printf(text_t *text, const char *fmt, ...)
+{
+	va_list		 ap;
+	char		*buf;
+	size_t		 size;
+	int			 len;
 
-	free(arg);
-	return NULL;
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(text->buf + text->len, text->size - text->len,
+						fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		if (text->len + len < text->size) {
+			text->len += len;
+			return;
+		}
+		size = text->size ? text->size * 2 : 8192;
+		while (size <= text->len + len)
+			size *= 2;
+		buf = realloc(text->buf, size);
+		if (buf == NULL)
+			return;
+		text->buf = buf;
+		text->size = size;
+	}
 }
 
 static void
-daemon_main()
+stats_help(text_t *text, const char *name, const char *type,
+				const char *help)
 {
-	pthread_attr_t	 attr;
-	pthread_t		 th;
+	text_printf(text, "# HELP %s %s\n# TYPE %s %s\n",
+					name, help, name, type);
+}
 
-	request_t		*req;
-	char			 buf[4096];
-	fd_set			 rfd;
-	fd_set			 sfd;
-	int				 maxfd;
+/* How often one cache was consulted. */
+typedef
+struct _stats_cache_t {
+	const char		*name;
+	unsigned long	 hits;
+	unsigned long	 misses;
+} stats_cache_t;
 
+static int
+stats_cache_add(stats_cache_t *caches, int ncaches, const char *name,
+				unsigned long hits, unsigned long misses)
+{
+	caches[ncaches].name = name;
+	caches[ncaches].hits = hits;
+	caches[ncaches].misses = misses;
+	return ncaches + 1;
+}
 
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+static void
+stats_hist(text_t *text, const char *name, hist_t *hist)
+{
+	unsigned long	 cumulative;
+	int				 i;
+
+	cumulative = 0;
+	for (i = 0; i < hist->nbounds; i++) {
+		cumulative += hist->bucket[i];
+		text_printf(text, "%s_bucket{le=\"%g\"} %lu\n",
+						name, hist->bounds[i], cumulative);
+	}
+	text_printf(text, "%s_bucket{le=\"+Inf\"} %lu\n", name, hist->count);
+	text_printf(text, "%s_sum %g\n", name, hist->sum);
+	text_printf(text, "%s_count %lu\n", name, hist->count);
+}
+
+static void
+stats_format(text_t *text)
+{
+	stats_t				 stats;
+	SPF_server_stats_t	 server;
+	server_t			*current;
+	bool				 result_cache;
+	bool				 exp_cache;
+	stats_cache_t		 caches[5];
+	int					 ncaches;
+	int					 depth;
+	int					 admitted;
+	int					 i;
+
+	/*
+	 * Take a copy, so as not to hold up the workers while we print.
+	 * server_lock keeps a reload from moving counts between the
+	 * current server and stats.retired while we read both.
+	 */
+	pthread_mutex_lock(&spfd_state.server_lock);
+	pthread_mutex_lock(&spfd_state.stats.lock);
+	stats = spfd_state.stats;
+	pthread_mutex_unlock(&spfd_state.stats.lock);
+	current = spfd_state.server;
+	SPF_server_get_stats(current->spf_server, &server);
+	result_cache = current->spf_server->result_cache != NULL;
+	exp_cache = current->spf_server->exp_cache != NULL;
+	pthread_mutex_unlock(&spfd_state.server_lock);
+	server.result_hits += stats.retired.result_hits;
+	server.result_misses += stats.retired.result_misses;
+	server.exp_hits += stats.retired.exp_hits;
+	server.exp_misses += stats.retired.exp_misses;
+	pthread_mutex_lock(&spfd_state.pool.lock);
+	depth = spfd_state.pool.depth;
+	pthread_mutex_unlock(&spfd_state.pool.lock);
+	pthread_mutex_lock(&spfd_state.admit_lock);
+	admitted = spfd_state.admitted;
+	pthread_mutex_unlock(&spfd_state.admit_lock);
+
+	stats_help(text, "spfd_requests_total", "counter",
+					"Requests answered, by protocol.");
+	for (i = 0; i < PROTO_STATS; i++)
+		text_printf(text, "spfd_requests_total{protocol=\"%s\"} %lu\n",
+						stats_protos[i], stats.requests[i]);
+
+	stats_help(text, "spfd_shed_total", "counter",
+					"Requests turned away as the server was busy.");
+	text_printf(text, "spfd_shed_total %lu\n", stats.shed);
+
+	stats_help(text, "spfd_results_total", "counter",
+					"Requests answered, by SPF result.");
+	for (i = SPF_RESULT_NEUTRAL; i <= SPF_RESULT_PERMERROR; i++)
+		text_printf(text, "spfd_results_total{result=\"%s\"} %lu\n",
+						SPF_strresult(i), stats.results[i]);
+	text_printf(text, "spfd_results_total{result=\"unknown\"} %lu\n",
+					stats.unknown);
+
+	stats_help(text, "spfd_evaluations_total", "counter",
+					"SPF evaluations run, rather than shared or remembered.");
+	text_printf(text, "spfd_evaluations_total %lu\n", stats.evaluations);
+
+	stats_help(text, "spfd_request_duration_seconds", "histogram",
+					"Time from reading a request to having its answer.");
+	stats_hist(text, "spfd_request_duration_seconds",
+					&stats.request_seconds);
+	stats_help(text, "spfd_evaluation_duration_seconds", "histogram",
+					"Time taken by one SPF evaluation.");
+	stats_hist(text, "spfd_evaluation_duration_seconds",
+					&stats.evaluation_seconds);
+	stats_help(text, "spfd_evaluation_dns_lookups", "histogram",
+					"DNS lookups made by one SPF evaluation, cached or not.");
+	stats_hist(text, "spfd_evaluation_dns_lookups",
+					&stats.evaluation_lookups);
+
+	/* From the outside in: a miss in one is a lookup in the next. */
+	ncaches = 0;
+	ncaches = stats_cache_add(caches, ncaches, "memo", stats.memo,
+					stats.coalesced + stats.evaluations);
+	ncaches = stats_cache_add(caches, ncaches, "coalesce",
+					stats.coalesced, stats.evaluations);
+	if (result_cache)
+		ncaches = stats_cache_add(caches, ncaches, "result",
+						server.result_hits, server.result_misses);
+	if (exp_cache)
+		ncaches = stats_cache_add(caches, ncaches, "explanation",
+						server.exp_hits, server.exp_misses);
+	ncaches = stats_cache_add(caches, ncaches, "dns",
+					stats.dns_lookups - stats.dns_queries, stats.dns_queries);
+	stats_help(text, "spfd_cache_hits_total", "counter",
+					"Lookups answered by each cache.");
+	for (i = 0; i < ncaches; i++)
+		text_printf(text, "spfd_cache_hits_total{cache=\"%s\"} %lu\n",
+						caches[i].name, caches[i].hits);
+	stats_help(text, "spfd_cache_misses_total", "counter",
+					"Lookups each cache passed on.");
+	for (i = 0; i < ncaches; i++)
+		text_printf(text, "spfd_cache_misses_total{cache=\"%s\"} %lu\n",
+						caches[i].name, caches[i].misses);
+
+	stats_help(text, "spfd_reloads_total", "counter",
+					"Settings reloads on SIGHUP, by outcome.");
+	text_printf(text, "spfd_reloads_total{outcome=\"ok\"} %lu\n",
+					stats.reloads);
+	text_printf(text, "spfd_reloads_total{outcome=\"failed\"} %lu\n",
+					stats.reload_failures);
+
+	stats_help(text, "spfd_queue_depth", "gauge",
+					"Requests waiting for a worker.");
+	text_printf(text, "spfd_queue_depth %d\n", depth);
+	stats_help(text, "spfd_queue_limit", "gauge",
+					"Most requests that may wait for a worker.");
+	text_printf(text, "spfd_queue_limit %d\n", spfd_config.queue);
+	stats_help(text, "spfd_workers", "gauge",
+					"Threads evaluating requests.");
+	text_printf(text, "spfd_workers %d\n", spfd_config.workers);
+	if (spfd_config.inflight || spfd_config.perip) {
+		stats_help(text, "spfd_admitted", "gauge",
+						"Requests admitted and not yet answered.");
+		text_printf(text, "spfd_admitted %d\n", admitted);
+	}
+}
 
-	FD_ZERO(&rfd);
-	maxfd = 0;
 
-	if (spfd_state.sock_udp) {
-		// printf("UDP socket is %d\n", spfd_state.sock_udp);
-		FD_SET(spfd_state.sock_udp, &rfd);
-		if (spfd_state.sock_udp > maxfd)
-			maxfd = spfd_state.sock_udp;
+/*
+ * Admission control. With -inflight, no more than that many requests
+ * are queued or being evaluated at once; with -perip, no more than
+ * that many are about any one client address. A request over either
+ * limit is answered at once with a temporary error, so that the MTA
+ * can retry, rather than left to time out.
+ */
+
+static void loop_complete(loop_t *loop, request_t *req);
+
+static bool
+request_admit(request_t *req)
+{
+	char			 buf[INET6_ADDRSTRLEN];
+	const char		*addr;
+	unsigned int	 hash;
+	perip_t			*pi;
+
+	if (spfd_config.inflight == 0 && spfd_config.perip == 0)
+		return TRUE;
+
+	pthread_mutex_lock(&spfd_state.admit_lock);
+	if (spfd_config.inflight && spfd_state.admitted >= spfd_config.inflight) {
+		pthread_mutex_unlock(&spfd_state.admit_lock);
+		return FALSE;
 	}
-	if (spfd_state.sock_tcp) {
-		// printf("TCP socket is %d\n", spfd_state.sock_tcp);
-		FD_SET(spfd_state.sock_tcp, &rfd);
-		if (spfd_state.sock_tcp > maxfd)
-			maxfd = spfd_state.sock_tcp;
+
+	if (spfd_config.perip && (req->ip || req->family)) {
+		addr = request_addr(req, buf);
+		hash = flight_hash(addr, strlen(addr));
+		for (pi = spfd_state.perip[hash % SPFD_PERIP_BUCKETS];
+						pi != NULL; pi = pi->next)
+			if (pi->hash == hash
+					&& strncmp(pi->addr, addr, sizeof(pi->addr) - 1) == 0)
+				break;
+		if (pi != NULL && pi->count >= spfd_config.perip) {
+			pthread_mutex_unlock(&spfd_state.admit_lock);
+			return FALSE;
+		}
+		/* If this fails, the client goes uncounted. */
+		if (pi == NULL && (pi = calloc(1, sizeof(perip_t))) != NULL) {
+			pi->hash = hash;
+			snprintf(pi->addr, sizeof(pi->addr), "%s", addr);
+			pi->next = spfd_state.perip[hash % SPFD_PERIP_BUCKETS];
+			spfd_state.perip[hash % SPFD_PERIP_BUCKETS] = pi;
+		}
+		if (pi != NULL)
+			pi->count++;
+		req->perip = pi;
 	}
-	if (spfd_state.sock_unix) {
-		// printf("UNIX socket is %d\n", spfd_state.sock_unix);
-		FD_SET(spfd_state.sock_unix, &rfd);
-		if (spfd_state.sock_unix > maxfd)
-			maxfd = spfd_state.sock_unix;
+
+	spfd_state.admitted++;
+	req->admitted = TRUE;
+	pthread_mutex_unlock(&spfd_state.admit_lock);
+	return TRUE;
+}
+
+static void
+request_release(request_t *req)
+{
+	perip_t		**pip;
+	perip_t		*pi;
+
+	if (!req->admitted)
+		return;
+
+	pthread_mutex_lock(&spfd_state.admit_lock);
+	spfd_state.admitted--;
+	pi = req->perip;
+	if (pi != NULL && --pi->count == 0) {
+		pip = &spfd_state.perip[pi->hash % SPFD_PERIP_BUCKETS];
+		while (*pip != pi)
+			pip = &(*pip)->next;
+		*pip = pi->next;
+		free(pi);
 	}
-	// printf("MaxFD is %d\n", maxfd);
+	pthread_mutex_unlock(&spfd_state.admit_lock);
 
-#define NEW_REQUEST	((request_t *)calloc(1, sizeof(request_t)));
+	req->admitted = FALSE;
+	req->perip = NULL;
+}
 
-	for (;;) {
-		memcpy(&sfd, &rfd, sizeof(rfd));
-		if (select(maxfd + 1, &sfd, NULL, NULL, NULL) == -1)
-			break;
+/* Answers req with "busy" in its protocol. */
+static void
+request_shed(request_t *req)
+{
+	unsigned char	*start;
+	unsigned char	*p;
 
-		if (spfd_state.sock_udp) {
-			if (FD_ISSET(spfd_state.sock_udp, &sfd)) {
-				req = NEW_REQUEST;
-				req->addrlen = sizeof(req->addr);
-				// printf("UDP\n");
-				req->sock = spfd_state.sock_udp;
-				req->datalen = recvfrom(spfd_state.sock_udp, buf,4095,0,
-					(struct sockaddr *)(&req->addr.in), &req->addrlen);
-				if (req->datalen >= 0) {
-					buf[req->datalen] = '\0';
-					req->data = strdup(buf);
-					pthread_create(&th, &attr, handle_datagram, req);
-				}
-				else {
-					free(req);
-				}
-			}
-		}
-		if (spfd_state.sock_tcp) {
-			if (FD_ISSET(spfd_state.sock_tcp, &sfd)) {
-				req = NEW_REQUEST;
-				req->addrlen = sizeof(req->addr);
-				// printf("TCP\n");
-				req->sock = accept(spfd_state.sock_tcp,
-					(struct sockaddr *)(&req->addr.in), &req->addrlen);
-				if (req->sock >= 0)
-					pthread_create(&th, &attr, handle_stream, req);
-				else
-					free(req);
-			}
-		}
-		if (spfd_state.sock_unix) {
-			if (FD_ISSET(spfd_state.sock_unix, &sfd)) {
-				req = NEW_REQUEST;
-				req->addrlen = sizeof(req->addr);
-				// printf("UNIX\n");
-				req->sock = accept(spfd_state.sock_unix,
-					(struct sockaddr *)(&req->addr.un), &req->addrlen);
-				if (req->sock >= 0)
-					pthread_create(&th, &attr, handle_stream, req);
-				else
-					free(req);
-			}
-		}
+	switch (req->proto) {
+		case PROTO_POLICY:
+			req->fmtlen = snprintf(req->fmt, 4095,
+				"action=451 4.3.2 Server busy, try again later\n\n");
+			break;
+		case PROTO_BINARY:
+			start = (unsigned char *)req->fmt;
+			p = start + 4;
+			*p++ = SPFD_BIN_VERSION;
+			*p++ = SPFD_BIN_BUSY;
+			p = bin_put32(p, req->bin_id);
+			*p++ = SPF_RESULT_TEMPERROR;
+			*p++ = SPF_REASON_NONE;
+			p = bin_put16(p, SPF_E_SUCCESS);
+			bin_put32(start, p - start - 4);
+			req->fmtlen = p - start;
+			break;
+		default:
+			req->fmtlen = snprintf(req->fmt, 4095,
+				"result=temperror\n"
+				"reason=Server busy\n");
+			if (req->id)
+				request_tag(req);
+			break;
 	}
+}
 
-	pthread_attr_destroy(&attr);
+/*
+ * Called by a loop with a request it has read: parses it, and either
+ * admits it, or answers it at once. The answer goes out through the
+ * loop's completion list like any other, so that this never re-enters
+ * the connection code.
+ */
+static bool
+loop_admit(loop_t *loop, request_t *req)
+{
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+	request_parse(req);
+	if (request_admit(req))
+		return TRUE;
+	request_shed(req);
+	stats_shed(req);
+	loop_complete(loop, req);
+	return FALSE;
+}
+
+
+/*
+ * The worker pool. The queue is bounded. Under admission control, a
+ * request which finds it full is answered at once, like one over the
+ * limits, since -inflight and -perip need not fit in -queue. Without
+ * it, the event loop waits for a worker, and so stops reading its
+ * sockets until the workers catch up.
+ */
+
+/* Queues a burst of requests, taking the lock once where there is room. */
+static void
+pool_push_n(pool_t *pool, request_t **reqs, int nreq)
+{
+	bool	 shed = spfd_config.inflight || spfd_config.perip;
+	int		 added;
+	int		 i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < nreq; ) {
+		while (!shed && pool->depth >= spfd_config.queue)
+			pthread_cond_wait(&pool->not_full, &pool->lock);
+		if (pool->depth >= spfd_config.queue)
+			break;
+		for (added = 0; i < nreq && pool->depth < spfd_config.queue; i++) {
+			reqs[i]->next = NULL;
+			if (pool->tail)
+				pool->tail->next = reqs[i];
+			else
+				pool->head = reqs[i];
+			pool->tail = reqs[i];
+			pool->depth++;
+			added++;
+		}
+		if (added > 1)
+			pthread_cond_broadcast(&pool->not_empty);
+		else
+			pthread_cond_signal(&pool->not_empty);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	/* Anything left did not fit, and is answered by its loop. */
+	for (; i < nreq; i++) {
+		request_release(reqs[i]);
+		request_shed(reqs[i]);
+		stats_shed(reqs[i]);
+		loop_complete(reqs[i]->loop, reqs[i]);
+	}
+}
+
+static void
+pool_push(pool_t *pool, request_t *req)
+{
+	pool_push_n(pool, &req, 1);
+}
+
+static request_t *
+pool_pop(pool_t *pool)
+{
+	request_t	*req;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->head == NULL)
+		pthread_cond_wait(&pool->not_empty, &pool->lock);
+	req = pool->head;
+	pool->head = req->next;
+	if (pool->head == NULL)
+		pool->tail = NULL;
+	pool->depth--;
+	pthread_cond_signal(&pool->not_full);
+	pthread_mutex_unlock(&pool->lock);
+
+	req->next = NULL;
+	return req;
+}
+
+/* Hands req back to its loop for the reply to be sent. */
+static void
+request_done(request_t *req)
+{
+	if (spfd_config.debug) {
+		printf("- %s\n", req->sender);
+		fflush(stdout);
+	}
+	request_release(req);
+	stats_done(req);
+	loop_complete(req->loop, req);
+}
+
+static void *
+worker_main(void *arg)
+{
+	pool_t		*pool;
+	request_t	*req;
+	request_t	*waiter;
+	request_t	*next;
+	dns_count_t	 count;
+
+	pool = (pool_t *)arg;
+	memset(&count, 0, sizeof(count));
+	pthread_setspecific(spfd_state.dns_key, &count);
+	for (;;) {
+		req = pool_pop(pool);
+		if (!request_handle(req))
+			continue;
+
+		/* Once completed, req belongs to its loop again. */
+		for (waiter = flight_end(req); waiter != NULL; waiter = next) {
+			next = waiter->next;
+			if (req->result)
+				waiter->result = result_ref(req->result);
+			else
+				waiter->spf_err = req->spf_err;
+			request_reply(waiter, TRUE);
+			request_done(waiter);
+		}
+		request_done(req);
+	}
+	return NULL;
+}
+
+static void
+pool_start(pool_t *pool)
+{
+	pthread_attr_t	 attr;
+	pthread_t		 th;
+	int				 i;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pthread_cond_init(&pool->not_full, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < spfd_config.workers; i++) {
+		if (pthread_create(&th, &attr, worker_main, pool) != 0) {
+			perror("pthread_create");
+			DIE("Failed to start worker");
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+
+/*
+ * The event loop. This uses epoll where there is one, and poll()
+ * otherwise; only the loop's own thread changes what is watched.
+ */
+
+static void
+set_nonblock(int fd)
+{
+	int		 flags;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		DIE("Failed to make socket non-blocking");
+	}
+}
+
+static void
+loop_watch(loop_t *loop, ev_t *ev, int events)
+{
+#ifdef SPFD_EPOLL
+	struct epoll_event	 e;
+
+	if (ev->watched && ev->events == events)
+		return;
+	memset(&e, 0, sizeof(e));
+	if (events & EV_IN)
+		e.events |= EPOLLIN;
+	if (events & EV_OUT)
+		e.events |= EPOLLOUT;
+	e.data.ptr = ev;
+	if (epoll_ctl(loop->epfd, ev->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+					ev->fd, &e) < 0) {
+		perror("epoll_ctl");
+		DIE("Failed to watch socket");
+	}
+#else
+	ev_t	**watch;
+
+	if (!ev->watched) {
+		if (loop->nwatch == loop->swatch) {
+			loop->swatch = loop->swatch ? loop->swatch * 2 : 16;
+			watch = realloc(loop->watch, loop->swatch * sizeof(ev_t *));
+			if (watch == NULL)
+				DIE("Out of memory");
+			loop->watch = watch;
+		}
+		loop->watch[loop->nwatch++] = ev;
+	}
+#endif
+	ev->watched = TRUE;
+	ev->events = events;
+}
+
+static void
+loop_unwatch(loop_t *loop, ev_t *ev)
+{
+#ifndef SPFD_EPOLL
+	int		 i;
+#endif
+
+	if (!ev->watched)
+		return;
+#ifdef SPFD_EPOLL
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+#else
+	for (i = 0; i < loop->nwatch; i++) {
+		if (loop->watch[i] == ev) {
+			loop->watch[i] = loop->watch[--loop->nwatch];
+			break;
+		}
+	}
+#endif
+	ev->watched = FALSE;
+}
+
+/* Fills ready[] and revents[] with up to max events. */
+static int
+loop_wait(loop_t *loop, ev_t **ready, int *revents, int max)
+{
+#ifdef SPFD_EPOLL
+	struct epoll_event	 e[SPFD_MAX_EVENTS];
+	int					 n;
+	int					 i;
+
+	if (max > SPFD_MAX_EVENTS)
+		max = SPFD_MAX_EVENTS;
+	n = epoll_wait(loop->epfd, e, max, -1);
+	for (i = 0; i < n; i++) {
+		ready[i] = (ev_t *)e[i].data.ptr;
+		revents[i] = 0;
+		if (e[i].events & EPOLLIN)
+			revents[i] |= EV_IN;
+		if (e[i].events & EPOLLOUT)
+			revents[i] |= EV_OUT;
+		if (e[i].events & (EPOLLERR | EPOLLHUP))
+			revents[i] |= EV_ERR;
+	}
+	return n;
+#else
+	struct pollfd	*pfd;
+	int				 nfd;
+	int				 n;
+	int				 i;
+
+	nfd = loop->nwatch;
+	pfd = calloc(nfd, sizeof(struct pollfd));
+	if (pfd == NULL)
+		return -1;
+	for (i = 0; i < nfd; i++) {
+		pfd[i].fd = loop->watch[i]->fd;
+		if (loop->watch[i]->events & EV_IN)
+			pfd[i].events |= POLLIN;
+		if (loop->watch[i]->events & EV_OUT)
+			pfd[i].events |= POLLOUT;
+	}
+	if (poll(pfd, nfd, -1) < 0) {
+		free(pfd);
+		return -1;
+	}
+	n = 0;
+	for (i = 0; i < nfd && n < max; i++) {
+		if (pfd[i].revents == 0)
+			continue;
+		ready[n] = loop->watch[i];
+		revents[n] = 0;
+		if (pfd[i].revents & POLLIN)
+			revents[n] |= EV_IN;
+		if (pfd[i].revents & POLLOUT)
+			revents[n] |= EV_OUT;
+		if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+			revents[n] |= EV_ERR;
+		n++;
+	}
+	free(pfd);
+	return n;
+#endif
+}
+
+/* Called by a worker: hand a finished request back to its loop. */
+static void
+loop_complete(loop_t *loop, request_t *req)
+{
+	bool	 was_empty;
+
+	req->next = NULL;
+	pthread_mutex_lock(&loop->lock);
+	was_empty = (loop->done_head == NULL);
+	if (loop->done_tail)
+		loop->done_tail->next = req;
+	else
+		loop->done_head = req;
+	loop->done_tail = req;
+	pthread_mutex_unlock(&loop->lock);
+
+	/* The loop drains the whole list on one wakeup. */
+	if (was_empty) {
+		if (write(loop->wake_w, "", 1) < 0 && errno != EAGAIN)
+			perror("write");
+	}
+}
+
+/* The loop frees conn once it is done with the current batch. */
+static void
+conn_free(conn_t *conn)
+{
+	conn->reap_next = conn->loop->reap;
+	conn->loop->reap = conn;
+}
+
+static void
+loop_reap(loop_t *loop)
+{
+	conn_t	*conn;
+
+	while ((conn = loop->reap) != NULL) {
+		loop->reap = conn->reap_next;
+		FREE_STRING(conn->in);
+		FREE_STRING(conn->out);
+		free(conn);
+	}
+}
+
+/* Closes the socket now; the conn itself goes with its last request. */
+static void
+conn_kill(conn_t *conn)
+{
+	if (!conn->dead) {
+		loop_unwatch(conn->loop, &conn->ev);
+		close(conn->ev.fd);
+		conn->dead = TRUE;
+	}
+	if (conn->busy == 0)
+		conn_free(conn);
+}
+
+static void
+conn_flush(conn_t *conn)
+{
+	ssize_t		 len;
+
+	while (conn->outoff < conn->outlen) {
+		len = send(conn->ev.fd, conn->out + conn->outoff,
+						conn->outlen - conn->outoff, MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			conn->outoff = conn->outlen = 0;
+			conn->dead = TRUE;	/* conn_update() will clean up. */
+			loop_unwatch(conn->loop, &conn->ev);
+			close(conn->ev.fd);
+			return;
+		}
+		conn->outoff += len;
+	}
+	conn->outoff = conn->outlen = 0;
+}
+
+static void
+conn_write(conn_t *conn, const char *data, size_t len)
+{
+	char	*out;
+
+	if (conn->dead)
+		return;
+	out = realloc(conn->out, conn->outlen + len);
+	if (out == NULL) {
+		conn->closing = TRUE;
+		return;
+	}
+	conn->out = out;
+	memcpy(conn->out + conn->outlen, data, len);
+	conn->outlen += len;
+	conn_flush(conn);
+}
+
+/*
+ * Reads whatever the socket has, up to SPFD_MAX_REQUEST bytes of
+ * unparsed input.
+ */
+static void
+conn_read(conn_t *conn)
+{
+	ssize_t		 len;
+
+	if (conn->in == NULL) {
+		conn->in = malloc(SPFD_MAX_REQUEST + 1);
+		if (conn->in == NULL) {
+			conn->closing = TRUE;
+			return;
+		}
+	}
+	while (conn->inlen < SPFD_MAX_REQUEST) {
+		len = recv(conn->ev.fd, conn->in + conn->inlen,
+						SPFD_MAX_REQUEST - conn->inlen, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				conn->eof = TRUE;
+			return;
+		}
+		if (len == 0) {
+			conn->eof = TRUE;
+			return;
+		}
+		conn->inlen += len;
+	}
+}
+
+/*
+ * Finds a text request at the front of conn->in. It ends at a blank
+ * line, or at the end of the stream. Sets *startp and *endp around it
+ * and returns where the next begins, or NULL if it is not all here;
+ * then *startp is where what we have of it begins.
+ */
+static char *
+conn_frame_text(conn_t *conn, char **startp, char **endp)
+{
+	char		*start;
+	char		*p;
+	char		*in_end;
+
+	in_end = conn->in + conn->inlen;
+
+	/* Blank lines between requests are not requests. */
+	for (start = conn->in; start < in_end; start++)
+		if (*start != '\r' && *start != '\n')
+			break;
+	*startp = start;
+
+	for (p = start; p < in_end; p++) {
+		if (*p != '\n')
+			continue;
+		if (p + 1 < in_end && p[1] == '\n') {
+			*endp = p + 1;
+			return p + 2;
+		}
+		if (p + 2 < in_end && p[1] == '\r' && p[2] == '\n') {
+			*endp = p + 1;
+			return p + 3;
+		}
+	}
+	if (conn->eof && start < in_end) {
+		*endp = in_end;
+		return in_end;
+	}
+	return NULL;
+}
+
+/* As conn_frame_text(), for a length-prefixed binary request. */
+static char *
+conn_frame_binary(conn_t *conn, char **startp, char **endp)
+{
+	size_t		 len;
+
+	*startp = conn->in;
+	if (conn->inlen < 4)
+		return NULL;
+	len = bin_get32((unsigned char *)conn->in);
+	if (len > SPFD_MAX_REQUEST - 4) {
+		fprintf(stderr, "Request too long\n");
+		conn->closing = TRUE;
+		return NULL;
+	}
+	if (conn->inlen < 4 + len)
+		return NULL;
+	*startp = conn->in + 4;
+	*endp = conn->in + 4 + len;
+	return *endp;
+}
+
+/*
+ * A metrics connection gets one reply to whatever it sends, and is
+ * closed. The reply is wrapped in HTTP if the request looks like it,
+ * so that Prometheus can scrape the port directly.
+ */
+static bool
+conn_stats(conn_t *conn)
+{
+	text_t		 text;
+	char		 header[256];
+	char		*start;
+	char		*end;
+	int			 len;
+
+	if (conn_frame_text(conn, &start, &end) == NULL) {
+		if (conn->inlen >= SPFD_MAX_REQUEST)
+			conn->closing = TRUE;
+		return FALSE;
+	}
+
+	memset(&text, 0, sizeof(text));
+	stats_format(&text);
+	if (end - start >= 4 && strncmp(start, "GET ", 4) == 0) {
+		len = snprintf(header, sizeof(header),
+				"HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %lu\r\n"
+				"Connection: close\r\n"
+				"\r\n", (unsigned long)text.len);
+		conn_write(conn, header, len);
+	}
+	conn_write(conn, text.buf, text.len);
+	FREE_STRING(text.buf);
+
+	conn->inlen = 0;
+	conn->closing = TRUE;
+	return FALSE;
+}
+
+/* Takes the next request off the front of conn->in and queues it. */
+static bool
+conn_next(conn_t *conn)
+{
+	request_t	*req;
+	char		*start;
+	char		*end;
+	char		*next;
+	char		*in_end;
+
+	if (conn->in == NULL)
+		return FALSE;
+	if (conn->ev.proto == PROTO_STATS)
+		return conn_stats(conn);
+
+	in_end = conn->in + conn->inlen;
+	if (conn->ev.proto == PROTO_BINARY)
+		next = conn_frame_binary(conn, &start, &end);
+	else
+		next = conn_frame_text(conn, &start, &end);
+	if (next == NULL) {
+		/* Keep the partial request at the front. */
+		conn->inlen = in_end - start;
+		memmove(conn->in, start, conn->inlen);
+		if (conn->inlen >= SPFD_MAX_REQUEST) {
+			fprintf(stderr, "Request too long\n");
+			conn->closing = TRUE;
+		}
+		return FALSE;
+	}
+
+	req = request_new(conn->loop, conn);
+	if (req == NULL) {
+		conn->closing = TRUE;
+		return FALSE;
+	}
+	req->proto = conn->ev.proto;
+	req->datalen = end - start;
+	req->data = malloc(req->datalen + 1);
+	if (req->data == NULL) {
+		free(req);
+		conn->closing = TRUE;
+		return FALSE;
+	}
+	memcpy(req->data, start, req->datalen);
+	req->data[req->datalen] = '\0';
+
+	conn->inlen = in_end - next;
+	memmove(conn->in, next, conn->inlen);
+
+	if (conn->pipe_tail)
+		conn->pipe_tail->pipe_next = req;
+	else
+		conn->pipe_head = req;
+	conn->pipe_tail = req;
+	conn->busy++;
+	if (spfd_config.onerequest)
+		conn->closing = TRUE;
+	if (loop_admit(conn->loop, req))
+		pool_push(&spfd_state.pool, req);
+	return TRUE;
+}
+
+/*
+ * Decides what to do next with a conn: start the next request, close
+ * it, or wait for it. This may free conn.
+ */
+static void
+conn_update(conn_t *conn)
+{
+	int		 events;
+
+	if (conn->dead) {
+		if (conn->busy == 0)
+			conn_free(conn);
+		return;
+	}
+
+	/* Start what we have, unless the client is not reading replies. */
+	while (conn->busy < spfd_config.pipeline && !conn->closing
+			&& conn->outlen - conn->outoff < SPFD_MAX_OUTPUT) {
+		if (!conn_next(conn))
+			break;
+	}
+
+	/* A reply written above may have failed and closed the socket. */
+	if (conn->dead) {
+		if (conn->busy == 0)
+			conn_free(conn);
+		return;
+	}
+
+	if (conn->busy == 0 && conn->outoff == conn->outlen
+			&& (conn->eof || conn->closing)) {
+		shutdown(conn->ev.fd, SHUT_RDWR);
+		conn_kill(conn);
+		return;
+	}
+
+	events = 0;
+	if (conn->busy < spfd_config.pipeline && !conn->eof && !conn->closing
+			&& conn->outlen - conn->outoff < SPFD_MAX_OUTPUT)
+		events |= EV_IN;
+	if (conn->outoff < conn->outlen)
+		events |= EV_OUT;
+	loop_watch(conn->loop, &conn->ev, events);
+}
+
+static void
+conn_event(conn_t *conn, int revents)
+{
+	/* Killed earlier in this batch; it is unwatched now. */
+	if (conn->dead)
+		return;
+	if (revents & EV_OUT)
+		conn_flush(conn);
+	if (!conn->dead && (revents & (EV_IN | EV_ERR))) {
+		if (conn->busy > 0 && (revents & EV_ERR)) {
+			/* The client went away with requests in flight. */
+			conn_kill(conn);
+			return;
+		}
+		conn_read(conn);
+	}
+	conn_update(conn);
+}
+
+/*
+ * A worker has finished req. Tagged and binary replies go out at
+ * once; the rest
+ * wait for every request before them on the connection.
+ */
+static void
+conn_complete(conn_t *conn, request_t *req)
+{
+	request_t	*head;
+
+	req->done = TRUE;
+	if (req->id != NULL || req->proto == PROTO_BINARY) {
+		conn_write(conn, req->fmt, req->fmtlen);
+		req->sent = TRUE;
+	}
+
+	while ((head = conn->pipe_head) != NULL && head->done) {
+		conn->pipe_head = head->pipe_next;
+		if (conn->pipe_head == NULL)
+			conn->pipe_tail = NULL;
+		if (!head->sent)
+			conn_write(conn, head->fmt, head->fmtlen);
+		conn->busy--;
+		request_free(head);
+	}
+
+	conn_update(conn);
+}
+
+static void
+loop_accept(loop_t *loop, ev_t *ev)
+{
+	conn_t		*conn;
+	union {
+		struct sockaddr_in	in;
+		struct sockaddr_un	un;
+	}			 addr;
+	socklen_t	 addrlen;
+	int			 sock;
+
+	for (;;) {
+		addrlen = sizeof(addr);
+		sock = accept(ev->fd, (struct sockaddr *)&addr, &addrlen);
+		if (sock < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		set_nonblock(sock);
+		conn = (conn_t *)calloc(1, sizeof(conn_t));
+		if (conn == NULL) {
+			close(sock);
+			continue;
+		}
+		conn->ev.type = EV_CONN;
+		conn->ev.proto = ev->proto;
+		conn->ev.fd = sock;
+		conn->loop = loop;
+		loop_watch(loop, &conn->ev, EV_IN);
+	}
+}
+
+/* Returns a datagram request with an empty receive buffer. */
+static request_t *
+loop_udp_get(loop_t *loop, ev_t *ev)
+{
+	request_t	*req;
+
+	if (loop->nspare > 0) {
+		req = loop->spare[--loop->nspare];
+	}
+	else {
+		req = request_new(loop, NULL);
+		if (req == NULL)
+			return NULL;
+		req->data = malloc(SPFD_MAX_REQUEST);
+		if (req->data == NULL) {
+			free(req);
+			return NULL;
+		}
+	}
+	req->sock = ev->fd;
+	req->addrlen = sizeof(req->addr);
+	return req;
+}
+
+/* Takes back a datagram request which the workers are done with. */
+static void
+loop_udp_put(loop_t *loop, request_t *req)
+{
+	if (loop->nspare == SPFD_UDP_BURST) {
+		request_free(req);
+		return;
+	}
+	req->next = NULL;
+	req->ip = req->helo = req->sender = req->rcpt_to = req->id = NULL;
+	req->spf_err = SPF_E_SUCCESS;
+	result_unref(req->result);
+	req->result = NULL;
+	req->role = FLIGHT_NONE;
+	req->family = 0;
+	req->fmtlen = 0;
+	loop->spare[loop->nspare++] = req;
+}
+
+#ifdef SPFD_MMSG
+static void
+loop_recv(loop_t *loop, ev_t *ev)
+{
+	struct mmsghdr	 msgs[SPFD_UDP_BURST];
+	struct iovec	 iov[SPFD_UDP_BURST];
+	request_t		*reqs[SPFD_UDP_BURST];
+	request_t		*ok[SPFD_UDP_BURST];
+	int				 nreq;
+	int				 nok;
+	int				 n;
+	int				 i;
+
+	for (nreq = 0; nreq < SPFD_UDP_BURST; nreq++) {
+		reqs[nreq] = loop_udp_get(loop, ev);
+		if (reqs[nreq] == NULL)
+			break;
+		iov[nreq].iov_base = reqs[nreq]->data;
+		iov[nreq].iov_len = SPFD_MAX_REQUEST - 1;
+		memset(&msgs[nreq], 0, sizeof(msgs[nreq]));
+		msgs[nreq].msg_hdr.msg_name = &reqs[nreq]->addr;
+		msgs[nreq].msg_hdr.msg_namelen = reqs[nreq]->addrlen;
+		msgs[nreq].msg_hdr.msg_iov = &iov[nreq];
+		msgs[nreq].msg_hdr.msg_iovlen = 1;
+	}
+	if (nreq == 0)
+		return;
+
+	n = recvmmsg(ev->fd, msgs, nreq, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			perror("recvmmsg");
+		n = 0;
+	}
+
+	for (i = 0, nok = 0; i < n; i++) {
+		reqs[i]->datalen = msgs[i].msg_len;
+		reqs[i]->addrlen = msgs[i].msg_hdr.msg_namelen;
+		reqs[i]->data[reqs[i]->datalen] = '\0';
+		if (loop_admit(loop, reqs[i]))
+			ok[nok++] = reqs[i];
+	}
+	pool_push_n(&spfd_state.pool, ok, nok);
+	for (; i < nreq; i++)
+		loop_udp_put(loop, reqs[i]);
+}
+
+/* Sends the datagram replies in reqs, then recycles the requests. */
+static void
+loop_udp_flush(loop_t *loop, request_t **reqs, int nreq)
+{
+	struct mmsghdr	 msgs[SPFD_UDP_BURST];
+	struct iovec	 iov[SPFD_UDP_BURST];
+	int				 off;
+	int				 n;
+	int				 i;
+
+	if (nreq == 0)
+		return;
+
+	for (i = 0; i < nreq; i++) {
+		iov[i].iov_base = reqs[i]->fmt;
+		iov[i].iov_len = reqs[i]->fmtlen;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &reqs[i]->addr;
+		msgs[i].msg_hdr.msg_namelen = reqs[i]->addrlen;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* All of a batch go out through the same socket. */
+	for (off = 0; off < nreq; off += n) {
+		n = sendmmsg(reqs[0]->sock, msgs + off, nreq - off, MSG_DONTWAIT);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			/* Drop the one that failed, as sendto() would. */
+			perror("sendmmsg");
+			n = 1;
+		}
+	}
+
+	for (i = 0; i < nreq; i++)
+		loop_udp_put(loop, reqs[i]);
+}
+#else
+static void
+loop_recv(loop_t *loop, ev_t *ev)
+{
+	request_t	*req;
+	int			 i;
+
+	for (i = 0; i < SPFD_UDP_BURST; i++) {
+		req = loop_udp_get(loop, ev);
+		if (req == NULL)
+			return;
+		req->datalen = recvfrom(ev->fd, req->data, SPFD_MAX_REQUEST - 1, 0,
+					(struct sockaddr *)(&req->addr.in), &req->addrlen);
+		if (req->datalen < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("recvfrom");
+			loop_udp_put(loop, req);
+			return;
+		}
+		req->data[req->datalen] = '\0';
+		if (loop_admit(loop, req))
+			pool_push(&spfd_state.pool, req);
+	}
+}
+
+static void
+loop_udp_flush(loop_t *loop, request_t **reqs, int nreq)
+{
+	int		 i;
+
+	for (i = 0; i < nreq; i++) {
+		if (sendto(reqs[i]->sock, reqs[i]->fmt, reqs[i]->fmtlen,
+				MSG_DONTWAIT, (struct sockaddr *)(&reqs[i]->addr.in),
+				reqs[i]->addrlen) < 0)
+			perror("sendto");
+		loop_udp_put(loop, reqs[i]);
+	}
+}
+#endif
+
+/* Sends the replies which the workers have finished. */
+static void
+loop_done(loop_t *loop)
+{
+	request_t	*req;
+	request_t	*next;
+	request_t	*udp[SPFD_UDP_BURST];
+	int			 nudp;
+	conn_t		*conn;
+	char		 buf[256];
+
+	while (read(loop->wake.fd, buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&loop->lock);
+	req = loop->done_head;
+	loop->done_head = loop->done_tail = NULL;
+	pthread_mutex_unlock(&loop->lock);
+
+	nudp = 0;
+	for (; req != NULL; req = next) {
+		next = req->next;
+		conn = req->conn;
+		if (conn == NULL) {
+#ifdef DEBUG
+			printf("Target address length is %d: %s:%d\n", req->addrlen,
+							inet_ntoa(req->addr.in.sin_addr),
+							req->addr.in.sin_port);
+#endif
+			if (nudp == SPFD_UDP_BURST
+					|| (nudp > 0 && udp[0]->sock != req->sock)) {
+				loop_udp_flush(loop, udp, nudp);
+				nudp = 0;
+			}
+			udp[nudp++] = req;
+			continue;
+		}
+		conn_complete(conn, req);
+	}
+	loop_udp_flush(loop, udp, nudp);
+}
+
+static void
+loop_listen(loop_t *loop, ev_t *ev, ev_type_t type, proto_t proto, int fd)
+{
+	ev->type = type;
+	ev->proto = proto;
+	ev->fd = fd;
+	set_nonblock(fd);
+	loop_watch(loop, ev, EV_IN);
+}
+
+/* Only the inet text sockets have one per listener. */
+static void
+loop_init(loop_t *loop, int idx)
+{
+	int		 fds[2];
+
+	memset(loop, 0, sizeof(*loop));
+	pthread_mutex_init(&loop->lock, NULL);
+#ifdef SPFD_EPOLL
+	loop->epfd = epoll_create(SPFD_MAX_EVENTS);
+	if (loop->epfd < 0) {
+		perror("epoll_create");
+		DIE("Failed to create event loop");
+	}
+#endif
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		DIE("Failed to create wake pipe");
+	}
+	set_nonblock(fds[0]);
+	set_nonblock(fds[1]);
+	loop->wake.type = EV_WAKE;
+	loop->wake.fd = fds[0];
+	loop->wake_w = fds[1];
+	loop_watch(loop, &loop->wake, EV_IN);
+
+	if (spfd_state.sock_udp[idx])
+		loop_listen(loop, &loop->udp, EV_UDP, PROTO_TEXT,
+						spfd_state.sock_udp[idx]);
+	if (spfd_state.sock_tcp[idx])
+		loop_listen(loop, &loop->tcp, EV_TCP, PROTO_TEXT,
+						spfd_state.sock_tcp[idx]);
+	if (idx > 0)
+		return;
+
+	/* These keep their connections open; one loop will do. */
+	if (spfd_state.sock_unix)
+		loop_listen(loop, &loop->unx, EV_UNIX, PROTO_TEXT,
+						spfd_state.sock_unix);
+	if (spfd_state.sock_policy_tcp)
+		loop_listen(loop, &loop->policy_tcp, EV_TCP, PROTO_POLICY,
+						spfd_state.sock_policy_tcp);
+	if (spfd_state.sock_policy_unix)
+		loop_listen(loop, &loop->policy_unx, EV_UNIX, PROTO_POLICY,
+						spfd_state.sock_policy_unix);
+	if (spfd_state.sock_bin_tcp)
+		loop_listen(loop, &loop->bin_tcp, EV_TCP, PROTO_BINARY,
+						spfd_state.sock_bin_tcp);
+	if (spfd_state.sock_bin_unix)
+		loop_listen(loop, &loop->bin_unx, EV_UNIX, PROTO_BINARY,
+						spfd_state.sock_bin_unix);
+	if (spfd_state.sock_stats_tcp)
+		loop_listen(loop, &loop->stats_tcp, EV_TCP, PROTO_STATS,
+						spfd_state.sock_stats_tcp);
+	if (spfd_state.sock_stats_unix)
+		loop_listen(loop, &loop->stats_unx, EV_UNIX, PROTO_STATS,
+						spfd_state.sock_stats_unix);
+}
+
+static void *
+loop_run(void *arg)
+{
+	loop_t	*loop = (loop_t *)arg;
+	ev_t	*ready[SPFD_MAX_EVENTS];
+	int		 revents[SPFD_MAX_EVENTS];
+	int		 n;
+	int		 i;
+
+	for (;;) {
+		n = loop_wait(loop, ready, revents, SPFD_MAX_EVENTS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("loop_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			switch (ready[i]->type) {
+				case EV_UDP:
+					loop_recv(loop, ready[i]);
+					break;
+				case EV_TCP:
+				case EV_UNIX:
+					loop_accept(loop, ready[i]);
+					break;
+				case EV_WAKE:
+					loop_done(loop);
+					break;
+				case EV_CONN:
+					conn_event((conn_t *)ready[i], revents[i]);
+					break;
+			}
+		}
+		loop_reap(loop);
+	}
+
+	return NULL;
+}
+
+static void
+daemon_main()
+{
+	pthread_attr_t	 attr;
+	pthread_t		 th;
+	sigset_t		 set;
+	int				 i;
+
+	/* Threads started from here on inherit this. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	spfd_state.loops = (loop_t *)calloc(spfd_config.listeners,
+					sizeof(loop_t));
+	if (spfd_state.loops == NULL)
+		DIE("Out of memory");
+
+	pthread_mutex_init(&spfd_state.flight_lock, NULL);
+	pthread_mutex_init(&spfd_state.admit_lock, NULL);
+	pool_start(&spfd_state.pool);
+	for (i = 0; i < spfd_config.listeners; i++)
+		loop_init(&spfd_state.loops[i], i);
+
+	/* The main thread runs the first loop itself. */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&th, &attr, server_signal_main, NULL) != 0) {
+		perror("pthread_create");
+		DIE("Failed to start signal handler");
+	}
+	for (i = 1; i < spfd_config.listeners; i++) {
+		if (pthread_create(&th, &attr, loop_run,
+						&spfd_state.loops[i]) != 0) {
+			perror("pthread_create");
+			DIE("Failed to start listener");
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	loop_run(&spfd_state.loops[0]);
 }
 
 int
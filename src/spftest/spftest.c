@@ -77,10 +77,59 @@ static void usage()
 {
 	printf( "Usage: spftest [spf \"<spf record>\" | domain <domain name>\n" );
 	printf( "                | ip <ip address> | exp \"<explanation string>\"\n" );
+	printf( "                | serialize \"<spf record>\" [<offset>=<byte> | len=<n>]...\n" );
 	printf( "                | version ]\n" );
 }
 
 
+/*
+ * Serializes the record and loads it again, so that the record printed
+ * is the one which came back.  Each edit either sets the byte at an
+ * offset in the serialized form, or cuts it to a length, so that the
+ * checks made on loading can be exercised.
+ */
+static SPF_errcode_t
+spftest_serialize(SPF_record_t **spf_recordp, int nedits, char *edits[])
+{
+	unsigned char	*data;
+	void			*buf;
+	size_t			 len;
+	unsigned long	 off;
+	char			*p;
+	SPF_errcode_t	 err;
+	int				 i;
+
+	err = SPF_record_serialize(*spf_recordp, &buf, &len);
+	SPF_record_free(*spf_recordp);
+	*spf_recordp = NULL;
+	if (err)
+		return err;
+
+	data = (unsigned char *)buf;
+	for (i = 0; i < nedits; i++) {
+		if ( strncmp( edits[i], "len=", 4 ) == 0 ) {
+			off = strtoul( edits[i] + 4, &p, 0 );
+			if ( *p != '\0' || off > len )
+				err = SPF_E_INVALID_OPT;
+			else
+				len = off;
+		}
+		else {
+			off = strtoul( edits[i], &p, 0 );
+			if ( *p != '=' || off >= len )
+				err = SPF_E_INVALID_OPT;
+			else
+				data[off] = strtoul( p + 1, NULL, 0 );
+		}
+	}
+
+	if (!err)
+		err = SPF_record_deserialize(spf_recordp, data, len);
+	free(buf);
+	return err;
+}
+
+
 int
 main( int argc, char *argv[] )
 {
@@ -127,6 +176,8 @@ main( int argc, char *argv[] )
 	}
 	else if ( strcmp( argv[1], "spf" ) == 0 )
 		spf_rec = argv[2];
+	else if ( strcmp( argv[1], "serialize" ) == 0 )
+		spf_rec = argv[2];
 	else if ( strcmp( argv[1], "domain" ) == 0 )
 	{
 		dns_rr = SPF_dns_lookup( spf_server->resolver, argv[2], ns_t_txt, TRUE );
@@ -198,6 +249,12 @@ main( int argc, char *argv[] )
 	printf( "SPF record in:  %s\n", spf_rec );
 	err = SPF_record_compile(spf_server, spf_response,
 					&spf_record, spf_rec);
+	if ( strcmp( argv[1], "serialize" ) == 0 && spf_record != NULL
+			&& err == SPF_E_SUCCESS ) {
+		err = spftest_serialize(&spf_record, argc - 3, argv + 3);
+		if (err)
+			SPF_response_add_error(spf_response, err, NULL);
+	}
 #if 0
 	printf("Code is %d with %d messages, %d errors\n",
 					err,